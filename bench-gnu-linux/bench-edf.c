@@ -0,0 +1,189 @@
+/*
+ * bench-edf.c - Benchmark of EDF scheduling.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+#if defined(CHX_SCHED_EDF)
+/*
+ * Periodic threads of the task set run for DURATION_USEC, with total
+ * utilization U.  Each thread has the share of U / NUM_TASK.  They are
+ * scheduled by fixed priorities (rate monotonic: shorter period, higher
+ * priority), and by EDF in a priority band.  It shows the number of
+ * missed deadlines, and the highest U where no deadline is missed.
+ *
+ * For this task set, rate monotonic misses deadlines above 80%,
+ * while EDF can schedule up to 100%, in theory.  On the emulation, the
+ * timer interrupt and context switches take some, too.  Periods are
+ * long, so that a short stop of the process by the host doesn't matter
+ * much.
+ *
+ * A job runs for its execution time by busy loop.  Time while another
+ * thread runs is not counted: a step longer than GAP_NS between two
+ * reads of the clock is considered as preemption.
+ */
+#define DURATION_USEC (3*1000*1000)
+#define GAP_NS 2000
+
+#define PRIO_EDF 20
+
+#define NUM_TASK 3
+static const uint32_t task_period[NUM_TASK] = { 30000, 40000, 50000 };
+static const uint8_t task_prio_rm[NUM_TASK] = { 30, 20, 10 };
+
+struct task {
+  uint32_t period;
+  uint32_t exec;
+  uint32_t jobs;
+  uint32_t missed;
+};
+
+static volatile int stop;
+
+static void
+job_run (uint32_t usec)
+{
+  uint64_t ns = usec * 1000ULL;
+  uint64_t done = 0;
+  uint64_t t0 = bench_ns ();
+
+  while (done < ns)
+    {
+      uint64_t t1 = bench_ns ();
+
+      if (t1 - t0 < GAP_NS)
+	done += t1 - t0;
+      t0 = t1;
+    }
+}
+
+static void *
+task_thread (void *arg)
+{
+  struct task *t = arg;
+
+  chopstx_periodic_start (t->period);
+  while (!stop)
+    {
+      job_run (t->exec);
+      t->jobs++;
+      if (chopstx_periodic_wait () > 0)
+	t->missed++;
+    }
+
+  return NULL;
+}
+
+/* Returns the number of missed deadlines.  */
+static uint32_t
+edf_run (int util, int edf, uint32_t *jobs_p)
+{
+  uintptr_t stack = bench_stack_alloc (NUM_TASK);
+  chopstx_t thd[NUM_TASK];
+  struct task task[NUM_TASK];
+  uint32_t missed = 0;
+  int i;
+
+  stop = 0;
+  *jobs_p = 0;
+  for (i = 0; i < NUM_TASK; i++)
+    {
+      uint32_t flags_and_prio;
+
+      task[i].period = task_period[i];
+      task[i].exec = task_period[i] * util / (100 * NUM_TASK);
+      task[i].jobs = task[i].missed = 0;
+      if (edf)
+	flags_and_prio = CHOPSTX_SCHED_EDF | PRIO_EDF;
+      else
+	flags_and_prio = task_prio_rm[i];
+      thd[i] = chopstx_create (flags_and_prio,
+			       stack + i * BENCH_STACK_SIZE,
+			       BENCH_STACK_SIZE, task_thread, &task[i]);
+    }
+
+  /* Don't join now, as join raises the priority of the thread.  */
+  chopstx_usec_wait (DURATION_USEC);
+  stop = 1;
+  for (i = 0; i < NUM_TASK; i++)
+    {
+      chopstx_join (thd[i], NULL);
+      missed += task[i].missed;
+      *jobs_p += task[i].jobs;
+    }
+
+  bench_stack_free (stack);
+  return missed;
+}
+
+int
+bench_edf (int argc, const char *argv[])
+{
+  static const int util_default[] = { 50, 60, 70, 80, 85, 90, 95 };
+  int num = argc ? argc : (int)(sizeof util_default / sizeof util_default[0]);
+  int ok[2] = { 0, 0 };
+  int failed[2] = { 0, 0 };
+  int i, edf;
+
+  printf ("periods (us): %u %u %u\n", task_period[0], task_period[1],
+	  task_period[2]);
+  printf ("U(%%)  fixed: missed / jobs    EDF: missed / jobs\n");
+  for (i = 0; i < num; i++)
+    {
+      int util = argc ? atoi (argv[i]) : util_default[i];
+
+      if (util <= 0 || util > 100)
+	continue;
+      printf ("%4d", util);
+      for (edf = 0; edf < 2; edf++)
+	{
+	  uint32_t jobs;
+	  uint32_t missed = edf_run (util, edf, &jobs);
+
+	  printf ("   %8u / %5u", missed, jobs);
+	  if (missed)
+	    failed[edf] = 1;
+	  else if (!failed[edf])
+	    ok[edf] = util;
+	}
+      printf ("\n");
+    }
+
+  printf ("\nno miss up to U(%%): fixed %d, EDF %d\n", ok[0], ok[1]);
+  return 0;
+}
+#else
+int
+bench_edf (int argc, const char *argv[])
+{
+  (void)argc;
+  (void)argv;
+  fprintf (stderr, "Build with BENCH_DEFS=-DCHX_SCHED_EDF for edf.\n");
+  return 1;
+}
+#endif
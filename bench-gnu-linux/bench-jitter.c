@@ -0,0 +1,149 @@
+/*
+ * bench-jitter.c - Benchmark of timer jitter.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+/*
+ * A thread sleeps by chopstx_usec_wait for USEC, repeatedly for about
+ * a second.  How late it wakes up is measured by CLOCK_MONOTONIC of
+ * the host in nanoseconds, and shown as a histogram.  Last, a sleep
+ * longer than a second is measured, for the remaining time of SYSTICK
+ * which doesn't fit in microseconds of a second.
+ */
+#define PRIO_JITTER 10
+
+#define MAX_COUNT 10000
+#define LONG_USEC 1500000
+
+/* Buckets of lateness: <1, <2, <4, ... <2^(NUM_BUCKET-2) us, and the rest.  */
+#define NUM_BUCKET 16
+
+struct jitter {
+  uint32_t usec;
+  int count;
+  uint32_t hist[NUM_BUCKET];
+  uint64_t late_sum;
+  uint64_t late_max;
+  int64_t early_max;
+};
+
+static void *
+jitter_thread (void *arg)
+{
+  struct jitter *j = arg;
+  int i, b;
+
+  for (i = 0; i < j->count; i++)
+    {
+      uint64_t t0 = bench_ns ();
+      int64_t late;
+
+      chopstx_usec_wait (j->usec);
+      late = (int64_t)(bench_ns () - t0) - (int64_t)j->usec * 1000;
+      if (late < 0)
+	{
+	  if (-late > j->early_max)
+	    j->early_max = -late;
+	  late = 0;
+	}
+
+      for (b = 0; b < NUM_BUCKET - 1; b++)
+	if ((uint64_t)late < (1000ULL << b))
+	  break;
+      j->hist[b]++;
+      j->late_sum += late;
+      if ((uint64_t)late > j->late_max)
+	j->late_max = late;
+    }
+
+  return NULL;
+}
+
+static void
+jitter_run (struct jitter *j)
+{
+  uintptr_t stack = bench_stack_alloc (1);
+  chopstx_t thd;
+
+  thd = chopstx_create (PRIO_JITTER, stack, BENCH_STACK_SIZE,
+			jitter_thread, j);
+  chopstx_join (thd, NULL);
+  bench_stack_free (stack);
+}
+
+static void
+jitter_print (struct jitter *j)
+{
+  int i;
+
+  printf ("%u us x %d: late avg %.2f us, max %.2f us",
+	  j->usec, j->count, (double)j->late_sum / j->count / 1000,
+	  j->late_max / 1000.0);
+  if (j->early_max)
+    printf (", EARLY max %.2f us", j->early_max / 1000.0);
+  printf ("\n");
+
+  for (i = 0; i < NUM_BUCKET; i++)
+    if (j->hist[i])
+      {
+	if (i < NUM_BUCKET - 1)
+	  printf ("  < %5u: %8u\n", 1U << i, j->hist[i]);
+	else
+	  printf ("  >=%5u: %8u\n", 1U << (i - 1), j->hist[i]);
+      }
+}
+
+int
+bench_jitter (int argc, const char *argv[])
+{
+  static const uint32_t usec_default[] = { 100, 1000, 10000 };
+  int num = argc ? argc : (int)(sizeof usec_default / sizeof usec_default[0]);
+  struct jitter j;
+  int i;
+
+  for (i = 0; i < num; i++)
+    {
+      uint32_t usec = argc ? (uint32_t)atoi (argv[i]) : usec_default[i];
+
+      if (usec == 0)
+	usec = 1;
+      j = (struct jitter){ .usec = usec, .count = 1000000 / usec };
+      if (j.count > MAX_COUNT)
+	j.count = MAX_COUNT;
+      else if (j.count == 0)
+	j.count = 1;
+      jitter_run (&j);
+      jitter_print (&j);
+    }
+
+  j = (struct jitter){ .usec = LONG_USEC, .count = 1 };
+  jitter_run (&j);
+  jitter_print (&j);
+  return 0;
+}
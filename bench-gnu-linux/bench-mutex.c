@@ -0,0 +1,153 @@
+/*
+ * bench-mutex.c - Benchmark of mutex.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+/*
+ * Uncontended: the main thread locks and unlocks a mutex, N times.
+ *
+ * Contended: a thread of PRIO_LOW locks the mutex and wakes up a
+ * thread of PRIO_HIGH, which tries to lock the mutex.  It waits with
+ * priority inheritance, and gets the mutex when the thread of PRIO_LOW
+ * unlocks it.  Each round has a wakeup, a wait on the mutex and three
+ * context switches.
+ *
+ * Build with BENCH_DEFS=-DCHX_MUTEX_FAST_PATH to compare the fast
+ * path by atomics, which is not default on GNU/Linux emulation.
+ */
+#define PRIO_LOW  10
+#define PRIO_HIGH 20
+
+static chopstx_mutex_t mtx;
+static chopstx_sem_t sem_high;
+static volatile int stop;
+static uint32_t locked;
+static int num_round;
+
+static void *
+mutex_high (void *arg)
+{
+  (void)arg;
+  while (1)
+    {
+      chopstx_sem_wait (&sem_high);
+      if (stop)
+	break;
+      chopstx_mutex_lock (&mtx);
+      locked++;
+      chopstx_mutex_unlock (&mtx);
+    }
+
+  return NULL;
+}
+
+static void *
+mutex_low (void *arg)
+{
+  int i;
+
+  (void)arg;
+  for (i = 0; i < num_round; i++)
+    {
+      chopstx_mutex_lock (&mtx);
+      chopstx_sem_post (&sem_high);
+      chopstx_mutex_unlock (&mtx);
+    }
+
+  stop = 1;
+  chopstx_sem_post (&sem_high);
+  return NULL;
+}
+
+static double
+mutex_uncontended (void)
+{
+  uint64_t t0;
+  int i;
+
+  chopstx_mutex_init (&mtx);
+  t0 = bench_ns ();
+  for (i = 0; i < num_round; i++)
+    {
+      chopstx_mutex_lock (&mtx);
+      chopstx_mutex_unlock (&mtx);
+    }
+
+  return (double)(bench_ns () - t0) / num_round;
+}
+
+static double
+mutex_contended (void)
+{
+  uintptr_t stack = bench_stack_alloc (2);
+  chopstx_t thd[2];
+  uint64_t t0;
+
+  chopstx_mutex_init (&mtx);
+  chopstx_sem_init (&sem_high, 0);
+  stop = 0;
+  locked = 0;
+
+  t0 = bench_ns ();
+  thd[0] = chopstx_create (PRIO_HIGH, stack, BENCH_STACK_SIZE,
+			   mutex_high, NULL);
+  thd[1] = chopstx_create (PRIO_LOW, stack + BENCH_STACK_SIZE,
+			   BENCH_STACK_SIZE, mutex_low, NULL);
+  /* Join the thread of PRIO_HIGH first, as join raises the priority.  */
+  chopstx_join (thd[0], NULL);
+  chopstx_join (thd[1], NULL);
+  t0 = bench_ns () - t0;
+
+  bench_stack_free (stack);
+  if (locked != (uint32_t)num_round)
+    printf ("BROKEN: %u rounds of %d\n", locked, num_round);
+  return (double)t0 / num_round;
+}
+
+int
+bench_mutex (int argc, const char *argv[])
+{
+  double ns;
+
+  num_round = argc > 0 ? atoi (argv[0]) : 1000000;
+  if (num_round <= 0)
+    num_round = 1;
+
+#if defined(CHX_MUTEX_FAST_PATH)
+  printf ("%d rounds, fast path\n", num_round);
+#else
+  printf ("%d rounds\n", num_round);
+#endif
+  printf ("              ns/round  round/s\n");
+  ns = mutex_uncontended ();
+  printf ("uncontended  %9.1f  %9.0f\n", ns, 1000000000 / ns);
+  ns = mutex_contended ();
+  printf ("contended    %9.1f  %9.0f\n", ns, 1000000000 / ns);
+  return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * bench-pingpong.c - Benchmark of context switch.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+/*
+ * Two threads of same priority wake up each other, N times.  Each
+ * round has two context switches.  Build with -DCHX_USE_UCONTEXT to
+ * compare the switch by ucontext_t, which involves the signal mask
+ * syscall of the host.
+ *
+ * It is done by semaphore, and by condition variable with mutex.
+ * CPU time of the process is also shown, so that the time of the
+ * host kernel (system) is seen.
+ */
+#define PRIO_PINGPONG 10
+
+static chopstx_sem_t sem[2];
+
+static chopstx_mutex_t mtx;
+static chopstx_cond_t cnd[2];
+static int turn;
+
+static int num_round;
+
+static void *
+pingpong_sem (void *arg)
+{
+  int me = (uintptr_t)arg;
+  int i;
+
+  for (i = 0; i < num_round; i++)
+    {
+      if (me)
+	chopstx_sem_wait (&sem[1]);
+      chopstx_sem_post (&sem[me ^ 1]);
+      if (!me)
+	chopstx_sem_wait (&sem[0]);
+    }
+
+  return NULL;
+}
+
+static void *
+pingpong_cond (void *arg)
+{
+  int me = (uintptr_t)arg;
+  int i;
+
+  chopstx_mutex_lock (&mtx);
+  for (i = 0; i < num_round; i++)
+    {
+      while (turn != me)
+	chopstx_cond_wait (&cnd[me], &mtx);
+      turn = me ^ 1;
+      chopstx_cond_signal (&cnd[me ^ 1]);
+    }
+  chopstx_mutex_unlock (&mtx);
+
+  return NULL;
+}
+
+static void
+pingpong_run (const char *name, void *(*func) (void *))
+{
+  uintptr_t stack = bench_stack_alloc (2);
+  chopstx_t thd[2];
+  struct timespec u0, u1;
+  uint64_t t0, cpu_ns;
+  int i;
+
+  chopstx_sem_init (&sem[0], 0);
+  chopstx_sem_init (&sem[1], 0);
+  chopstx_mutex_init (&mtx);
+  chopstx_cond_init (&cnd[0]);
+  chopstx_cond_init (&cnd[1]);
+  turn = 0;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &u0);
+  t0 = bench_ns ();
+  for (i = 0; i < 2; i++)
+    thd[i] = chopstx_create (PRIO_PINGPONG, stack + i * BENCH_STACK_SIZE,
+			     BENCH_STACK_SIZE, func, (void *)(uintptr_t)i);
+  for (i = 0; i < 2; i++)
+    chopstx_join (thd[i], NULL);
+  t0 = bench_ns () - t0;
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &u1);
+  cpu_ns = (uint64_t)(u1.tv_sec - u0.tv_sec) * 1000000000
+    + u1.tv_nsec - u0.tv_nsec;
+
+  printf ("%-5s  %9.1f  %9.0f  %9.1f\n", name,
+	  (double)t0 / (2.0 * num_round),
+	  2.0 * num_round * 1000000000 / t0,
+	  (double)cpu_ns / (2.0 * num_round));
+  bench_stack_free (stack);
+}
+
+int
+bench_pingpong (int argc, const char *argv[])
+{
+  num_round = argc > 0 ? atoi (argv[0]) : 1000000;
+  if (num_round <= 0)
+    num_round = 1;
+
+#if defined(CHX_USE_UCONTEXT)
+  printf ("%d rounds, ucontext_t\n", num_round);
+#else
+  printf ("%d rounds\n", num_round);
+#endif
+  printf ("       ns/switch  switch/s   CPU ns/switch\n");
+  pingpong_run ("sem", pingpong_sem);
+  pingpong_run ("cond", pingpong_cond);
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * bench-ready.c - Benchmark of READY queue.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+/*
+ * Each round, N threads of PRIO_READY are made ready first.  Then,
+ * the main thread wakes up NUM_WAKEE threads of lower priority, which
+ * is measured.  With the sorted list, each wakeup walks all N threads
+ * to find the place.  Last, the main thread sleeps until the thread
+ * of PRIO_LAST runs, so that all threads go back to wait.
+ */
+#define PRIO_READY 10
+#define PRIO_WAKEE 5
+#define PRIO_LAST  1
+
+#define NUM_WAKEE  16
+#define NUM_ROUND  1000
+
+static chopstx_sem_t sem_ready;
+static chopstx_sem_t sem_wakee[NUM_WAKEE];
+static chopstx_sem_t sem_last;
+static chopstx_sem_t sem_done;
+static volatile int stop;
+
+static void *
+waiter (void *arg)
+{
+  chopstx_sem_t *sem = arg;
+
+  while (1)
+    {
+      chopstx_sem_wait (sem);
+      if (stop)
+	break;
+      if (sem == &sem_last)
+	chopstx_sem_post (&sem_done);
+    }
+
+  return NULL;
+}
+
+/* Returns nanoseconds per wakeup, with N ready threads.  */
+static double
+ready_run (int n)
+{
+  int n_thd = n + NUM_WAKEE + 1;
+  uintptr_t stack = bench_stack_alloc (n_thd);
+  chopstx_t *thd = malloc (n_thd * sizeof (chopstx_t));
+  uint64_t t0, total = 0;
+  int i, r;
+
+  stop = 0;
+  chopstx_sem_init (&sem_ready, 0);
+  chopstx_sem_init (&sem_last, 0);
+  chopstx_sem_init (&sem_done, 0);
+  for (i = 0; i < n_thd; i++)
+    {
+      uint32_t prio;
+      chopstx_sem_t *sem;
+
+      if (i < n)
+	{
+	  prio = PRIO_READY;
+	  sem = &sem_ready;
+	}
+      else if (i < n + NUM_WAKEE)
+	{
+	  prio = PRIO_WAKEE;
+	  sem = &sem_wakee[i - n];
+	  chopstx_sem_init (sem, 0);
+	}
+      else
+	{
+	  prio = PRIO_LAST;
+	  sem = &sem_last;
+	}
+
+      thd[i] = chopstx_create (prio, stack + i * BENCH_STACK_SIZE,
+			       BENCH_STACK_SIZE, waiter, sem);
+    }
+
+  /* Let them wait.  */
+  chopstx_sem_post (&sem_last);
+  chopstx_sem_wait (&sem_done);
+
+  for (r = 0; r < NUM_ROUND; r++)
+    {
+      for (i = 0; i < n; i++)
+	chopstx_sem_post (&sem_ready);
+
+      t0 = bench_ns ();
+      for (i = 0; i < NUM_WAKEE; i++)
+	chopstx_sem_post (&sem_wakee[i]);
+      total += bench_ns () - t0;
+
+      chopstx_sem_post (&sem_last);
+      chopstx_sem_wait (&sem_done);
+    }
+
+  stop = 1;
+  for (i = 0; i < n; i++)
+    chopstx_sem_post (&sem_ready);
+  for (i = 0; i < NUM_WAKEE; i++)
+    chopstx_sem_post (&sem_wakee[i]);
+  chopstx_sem_post (&sem_last);
+  for (i = 0; i < n_thd; i++)
+    chopstx_join (thd[i], NULL);
+
+  free (thd);
+  bench_stack_free (stack);
+  return (double)total / (NUM_ROUND * NUM_WAKEE);
+}
+
+int
+bench_ready (int argc, const char *argv[])
+{
+  static const int n_default[] = { 0, 10, 100, 1000 };
+  int i;
+
+  printf ("ready threads  ns/wakeup\n");
+  if (argc == 0)
+    for (i = 0; i < (int)(sizeof n_default / sizeof n_default[0]); i++)
+      printf ("%13d  %9.1f\n", n_default[i], ready_run (n_default[i]));
+  else
+    for (i = 0; i < argc; i++)
+      {
+	int n = atoi (argv[i]);
+
+	printf ("%13d  %9.1f\n", n, ready_run (n));
+      }
+
+  return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * bench-rwlock.c - Benchmark of reader-writer lock.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+/*
+ * N readers and a writer share a table.  Each reader reads the table
+ * NUM_READ times, and the writer updates it NUM_WRITE times.  The
+ * emulation runs threads on one CPU, so, readers can only overlap
+ * when they sleep in the read section; they do so for READ_USEC, like
+ * reading a slow device.  The writer sleeps in the middle of an
+ * update, so that a reader sees a broken table if locking is wrong.
+ *
+ * It shows the elapsed time and the longest wait of the writer, with
+ * a mutex, the rwlock, and the rwlock with writer preference.  With
+ * the mutex, readers serialize and the time grows with N.
+ */
+#define PRIO_RW 10
+
+#define NUM_READ 50
+#define READ_USEC 200
+#define NUM_WRITE 10
+#define WRITE_USEC 100
+#define WRITE_INTERVAL_USEC 1000
+#define TABLE_SIZE 16
+
+#define NUM_LOOP 1000000
+
+enum lock_kind {
+  LOCK_MUTEX,
+  LOCK_RWLOCK,
+  LOCK_RWLOCK_PREFER_WRITER,
+  NUM_LOCK_KIND
+};
+
+static const char *const lock_name[NUM_LOCK_KIND] = {
+  "mutex", "rwlock", "rwlock-pw"
+};
+
+static enum lock_kind kind;
+static chopstx_mutex_t mtx;
+static chopstx_rwlock_t rw;
+static uint32_t table[TABLE_SIZE];
+static uint32_t broken;
+static uint64_t write_wait_max;
+
+static void
+lock_read (void)
+{
+  if (kind == LOCK_MUTEX)
+    chopstx_mutex_lock (&mtx);
+  else
+    chopstx_rwlock_rdlock (&rw);
+}
+
+static void
+lock_write (void)
+{
+  if (kind == LOCK_MUTEX)
+    chopstx_mutex_lock (&mtx);
+  else
+    chopstx_rwlock_wrlock (&rw);
+}
+
+static void
+unlock (void)
+{
+  if (kind == LOCK_MUTEX)
+    chopstx_mutex_unlock (&mtx);
+  else
+    chopstx_rwlock_unlock (&rw);
+}
+
+static void *
+reader (void *arg)
+{
+  int i, j;
+
+  (void)arg;
+  for (i = 0; i < NUM_READ; i++)
+    {
+      lock_read ();
+      chopstx_usec_wait (READ_USEC);
+      for (j = 1; j < TABLE_SIZE; j++)
+	if (table[j] != table[0])
+	  {
+	    broken++;
+	    break;
+	  }
+      unlock ();
+    }
+
+  return NULL;
+}
+
+static void *
+writer (void *arg)
+{
+  int i, j;
+
+  (void)arg;
+  for (i = 0; i < NUM_WRITE; i++)
+    {
+      uint64_t t0, wait;
+
+      chopstx_usec_wait (WRITE_INTERVAL_USEC);
+      t0 = bench_ns ();
+      lock_write ();
+      wait = bench_ns () - t0;
+      if (wait > write_wait_max)
+	write_wait_max = wait;
+      for (j = 0; j < TABLE_SIZE; j++)
+	{
+	  table[j]++;
+	  if (j == TABLE_SIZE / 2)
+	    chopstx_usec_wait (WRITE_USEC);
+	}
+      unlock ();
+    }
+
+  return NULL;
+}
+
+/* Returns elapsed nanoseconds, with N readers.  */
+static uint64_t
+rwlock_run (int n, enum lock_kind k)
+{
+  uintptr_t stack = bench_stack_alloc (n + 1);
+  chopstx_t *thd = malloc ((n + 1) * sizeof (chopstx_t));
+  uint64_t t0;
+  int i;
+
+  kind = k;
+  chopstx_mutex_init (&mtx);
+  chopstx_rwlock_init (&rw, k == LOCK_RWLOCK_PREFER_WRITER
+		       ? CHOPSTX_RWLOCK_PREFER_WRITER : 0);
+  write_wait_max = 0;
+
+  t0 = bench_ns ();
+  for (i = 0; i < n; i++)
+    thd[i] = chopstx_create (PRIO_RW, stack + i * BENCH_STACK_SIZE,
+			     BENCH_STACK_SIZE, reader, NULL);
+  thd[n] = chopstx_create (PRIO_RW, stack + n * BENCH_STACK_SIZE,
+			   BENCH_STACK_SIZE, writer, NULL);
+  for (i = 0; i <= n; i++)
+    chopstx_join (thd[i], NULL);
+  t0 = bench_ns () - t0;
+
+  free (thd);
+  bench_stack_free (stack);
+  return t0;
+}
+
+/* Returns nanoseconds per lock and unlock, without contention.  */
+static double
+rwlock_uncontended (int op)
+{
+  uint64_t t0;
+  int i;
+
+  chopstx_mutex_init (&mtx);
+  chopstx_rwlock_init (&rw, 0);
+
+  t0 = bench_ns ();
+  for (i = 0; i < NUM_LOOP; i++)
+    if (op == 0)
+      {
+	chopstx_mutex_lock (&mtx);
+	chopstx_mutex_unlock (&mtx);
+      }
+    else if (op == 1)
+      {
+	chopstx_rwlock_rdlock (&rw);
+	chopstx_rwlock_unlock (&rw);
+      }
+    else
+      {
+	chopstx_rwlock_wrlock (&rw);
+	chopstx_rwlock_unlock (&rw);
+      }
+
+  return (double)(bench_ns () - t0) / NUM_LOOP;
+}
+
+int
+bench_rwlock (int argc, const char *argv[])
+{
+  static const int n_default[] = { 1, 2, 4, 8, 16 };
+  int num = argc ? argc : (int)(sizeof n_default / sizeof n_default[0]);
+  int i, k;
+
+  printf ("lock/unlock (ns): mutex %.1f, rdlock %.1f, wrlock %.1f\n\n",
+	  rwlock_uncontended (0), rwlock_uncontended (1),
+	  rwlock_uncontended (2));
+
+  printf ("readers  lock        elapsed(ms)  writer wait max(us)\n");
+  for (i = 0; i < num; i++)
+    {
+      int n = argc ? atoi (argv[i]) : n_default[i];
+
+      if (n <= 0)
+	n = 1;
+      for (k = 0; k < NUM_LOCK_KIND; k++)
+	{
+	  uint64_t elapsed = rwlock_run (n, k);
+
+	  printf ("%7d  %-10s  %11.1f  %19.1f\n", n, lock_name[k],
+		  elapsed / 1000000.0, write_wait_max / 1000.0);
+	}
+    }
+
+  if (broken)
+    printf ("\nBROKEN: %u reads saw a table in update\n", broken);
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * bench-sleepers.c - Benchmark of timer queue.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+/*
+ * N threads sleep periodically by chopstx_sleep_until, with periods
+ * from 10ms to 49ms, for five seconds.  It shows how late they wake
+ * up (histogram in microseconds), and CPU time of the process per
+ * wakeup, which includes the timer interrupt handling and the context
+ * switches.
+ *
+ * All sleepers have the same priority, so that they don't preempt each
+ * other.  Thus, the statistics are updated without lock.
+ */
+#define PRIO_SLEEPER 10
+#define DURATION_USEC (5*1000*1000)
+
+/* Buckets of lateness: <1, <2, <4, ... <2^(NUM_BUCKET-2) us, and the rest.  */
+#define NUM_BUCKET 16
+
+static uint32_t hist[NUM_BUCKET];
+static uint64_t wakeups;
+static uint64_t late_sum;
+static uint32_t late_max;
+static uint64_t time_end;
+
+static void *
+sleeper (void *arg)
+{
+  uint32_t period = 10000 + ((uintptr_t)arg % 40) * 1000;
+  uint64_t deadline = chopstx_clock_gettime () + period;
+
+  while (deadline < time_end)
+    {
+      uint32_t late;
+      int i;
+
+      chopstx_sleep_until (deadline);
+      late = (uint32_t)(chopstx_clock_gettime () - deadline);
+
+      for (i = 0; i < NUM_BUCKET - 1; i++)
+	if (late < (1U << i))
+	  break;
+      hist[i]++;
+      wakeups++;
+      late_sum += late;
+      if (late > late_max)
+	late_max = late;
+
+      deadline += period;
+    }
+
+  return NULL;
+}
+
+int
+bench_sleepers (int argc, const char *argv[])
+{
+  int n = argc > 0 ? atoi (argv[0]) : 1000;
+  uintptr_t stack;
+  chopstx_t *thd;
+  struct timespec c0, c1;
+  uint64_t cpu_ns;
+  int i;
+
+  if (n <= 0)
+    n = 1;
+
+  stack = bench_stack_alloc (n);
+  thd = malloc (n * sizeof (chopstx_t));
+  time_end = chopstx_clock_gettime () + DURATION_USEC;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &c0);
+  for (i = 0; i < n; i++)
+    thd[i] = chopstx_create (PRIO_SLEEPER, stack + i * BENCH_STACK_SIZE,
+			     BENCH_STACK_SIZE, sleeper, (void *)(uintptr_t)i);
+  for (i = 0; i < n; i++)
+    chopstx_join (thd[i], NULL);
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &c1);
+  cpu_ns = (uint64_t)(c1.tv_sec - c0.tv_sec) * 1000000000
+    + c1.tv_nsec - c0.tv_nsec;
+
+  printf ("%d sleepers, %llu wakeups\n", n, (unsigned long long)wakeups);
+  printf ("CPU per wakeup: %.0f ns\n", (double)cpu_ns / wakeups);
+  printf ("late (us): avg %.1f, max %u\n",
+	  (double)late_sum / wakeups, late_max);
+  for (i = 0; i < NUM_BUCKET; i++)
+    if (hist[i])
+      {
+	if (i < NUM_BUCKET - 1)
+	  printf ("  < %5u: %8u\n", 1U << i, hist[i]);
+	else
+	  printf ("  >=%5u: %8u\n", 1U << (i - 1), hist[i]);
+      }
+
+  free (thd);
+  bench_stack_free (stack);
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * bench-wakeup.c - Benchmark of wakeup-to-run latency.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+/*
+ * A thread of PRIO_LOW wakes up a thread of PRIO_HIGH, N times.  The
+ * time from just before the wakeup until the woken thread runs is
+ * measured.  The wakeup is done by chopstx_cond_signal, and by
+ * chopstx_mutex_unlock (the thread of PRIO_HIGH waits for the mutex).
+ *
+ * Only condition variable and mutex are used, so that it can be
+ * compared with older versions of Chopstx.
+ */
+#define PRIO_LOW  10
+#define PRIO_HIGH 20
+
+static chopstx_mutex_t mtx;
+static chopstx_mutex_t mtx_held;
+static chopstx_cond_t cnd;
+static int flag;
+static int use_mutex;
+static int num_round;
+
+static uint64_t t_wakeup;
+static uint64_t lat_sum, lat_min, lat_max;
+
+static void
+wakeup_record (void)
+{
+  uint64_t lat = bench_ns () - t_wakeup;
+
+  lat_sum += lat;
+  if (lat < lat_min)
+    lat_min = lat;
+  if (lat > lat_max)
+    lat_max = lat;
+}
+
+static void *
+wakeup_high (void *arg)
+{
+  int i;
+
+  (void)arg;
+  for (i = 0; i < num_round; i++)
+    {
+      chopstx_mutex_lock (&mtx);
+      while (!flag)
+	chopstx_cond_wait (&cnd, &mtx);
+      flag = 0;
+      chopstx_mutex_unlock (&mtx);
+
+      if (use_mutex)
+	{
+	  chopstx_mutex_lock (&mtx_held);
+	  wakeup_record ();
+	  chopstx_mutex_unlock (&mtx_held);
+	}
+      else
+	wakeup_record ();
+    }
+
+  return NULL;
+}
+
+static void *
+wakeup_low (void *arg)
+{
+  int i;
+
+  (void)arg;
+  for (i = 0; i < num_round; i++)
+    {
+      if (use_mutex)
+	chopstx_mutex_lock (&mtx_held);
+
+      chopstx_mutex_lock (&mtx);
+      flag = 1;
+      chopstx_mutex_unlock (&mtx);
+      t_wakeup = bench_ns ();
+      chopstx_cond_signal (&cnd);
+
+      if (use_mutex)
+	{
+	  /* The thread of PRIO_HIGH waits for MTX_HELD, now.  */
+	  t_wakeup = bench_ns ();
+	  chopstx_mutex_unlock (&mtx_held);
+	}
+    }
+
+  return NULL;
+}
+
+static void
+wakeup_run (const char *name, int m)
+{
+  uintptr_t stack = bench_stack_alloc (2);
+  chopstx_t thd[2];
+
+  use_mutex = m;
+  flag = 0;
+  chopstx_mutex_init (&mtx);
+  chopstx_mutex_init (&mtx_held);
+  chopstx_cond_init (&cnd);
+  lat_sum = lat_max = 0;
+  lat_min = UINT64_MAX;
+
+  thd[0] = chopstx_create (PRIO_HIGH, stack, BENCH_STACK_SIZE,
+			   wakeup_high, NULL);
+  thd[1] = chopstx_create (PRIO_LOW, stack + BENCH_STACK_SIZE,
+			   BENCH_STACK_SIZE, wakeup_low, NULL);
+  /* Join the thread of PRIO_HIGH first, as join raises the priority.  */
+  chopstx_join (thd[0], NULL);
+  chopstx_join (thd[1], NULL);
+  bench_stack_free (stack);
+
+  printf ("%-6s  %8.1f  %8.1f  %10.1f\n", name,
+	  (double)lat_sum / num_round, lat_min / 1.0, lat_max / 1.0);
+}
+
+int
+bench_wakeup (int argc, const char *argv[])
+{
+  num_round = argc > 0 ? atoi (argv[0]) : 1000000;
+  if (num_round <= 0)
+    num_round = 1;
+
+  printf ("%d rounds\n", num_round);
+  printf ("ns         avg       min         max\n");
+  wakeup_run ("cond", 0);
+  wakeup_run ("mutex", 1);
+  return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * bench.c - Benchmarks of Chopstx on GNU/Linux emulation.
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <chopstx.h>
+
+#include "bench.h"
+
+struct bench {
+  const char *name;
+  int (*func) (int argc, const char *argv[]);
+  const char *desc;
+};
+
+static const struct bench bench_list[] = {
+  { "ready", bench_ready, "wakeup with N ready threads" },
+  { "sleepers", bench_sleepers, "N threads sleep periodically" },
+  { "rwlock", bench_rwlock, "N readers and a writer share a table" },
+  { "jitter", bench_jitter, "lateness of chopstx_usec_wait" },
+  { "pingpong", bench_pingpong, "two threads wake up each other" },
+  { "mutex", bench_mutex, "lock and unlock, with and without contention" },
+  { "wakeup", bench_wakeup, "latency from wakeup to run" },
+  { "edf", bench_edf, "periodic task set by fixed priority and EDF" },
+  { NULL, NULL, NULL }
+};
+
+/* Time of the host in nanoseconds.  */
+uint64_t
+bench_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Allocate N stacks of BENCH_STACK_SIZE, contiguously.  */
+uintptr_t
+bench_stack_alloc (int n)
+{
+  void *p = malloc ((size_t)n * BENCH_STACK_SIZE);
+
+  if (p == NULL)
+    {
+      fprintf (stderr, "No memory for %d stacks\n", n);
+      exit (1);
+    }
+
+  return (uintptr_t)p;
+}
+
+void
+bench_stack_free (uintptr_t stack)
+{
+  free ((void *)stack);
+}
+
+
+#define main emulated_main
+
+int
+main (int argc, const char *argv[])
+{
+  const struct bench *b;
+
+  if (argc >= 2)
+    for (b = bench_list; b->name; b++)
+      if (strcmp (argv[1], b->name) == 0)
+	{
+	  chopstx_setpriority (PRIO_BENCH_MAIN);
+	  return b->func (argc - 2, argv + 2);
+	}
+
+  fprintf (stderr, "Usage: %s NAME [ARG...]\n\n", argv[0]);
+  for (b = bench_list; b->name; b++)
+    fprintf (stderr, "  %-10s %s\n", b->name, b->desc);
+  return 1;
+}
@@ -0,0 +1,21 @@
+/*
+ * Benchmarks on GNU/Linux emulation.
+ */
+
+#define BENCH_STACK_SIZE (16*1024)
+
+/* Priority of the main thread while measuring.  */
+#define PRIO_BENCH_MAIN 200
+
+uint64_t bench_ns (void);
+uintptr_t bench_stack_alloc (int n);
+void bench_stack_free (uintptr_t stack);
+
+int bench_ready (int argc, const char *argv[]);
+int bench_sleepers (int argc, const char *argv[]);
+int bench_rwlock (int argc, const char *argv[]);
+int bench_jitter (int argc, const char *argv[]);
+int bench_pingpong (int argc, const char *argv[]);
+int bench_mutex (int argc, const char *argv[]);
+int bench_wakeup (int argc, const char *argv[]);
+int bench_edf (int argc, const char *argv[]);
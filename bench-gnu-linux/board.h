@@ -0,0 +1 @@
+../board/board-gnu-linux.h
\ No newline at end of file
@@ -103,31 +103,82 @@ static volatile uint32_t *const SYST_CSR = (uint32_t *)0xE000E010;
 static volatile uint32_t *const SYST_RVR = (uint32_t *)0xE000E014;
 static volatile uint32_t *const SYST_CVR = (uint32_t *)0xE000E018;
 
+#define SYST_CSR_COUNTFLAG (1 << 16)
+#define SYSTICK_MAX 0x00ffffff
+
+/*
+ * SysTick is programmed to count TICKS, and then, it continues to
+ * count from SYSTICK_MAX, so that the time after the expiry (latency
+ * of interrupt and processing) is counted as well.  The wrap at the
+ * expiry is detected by COUNTFLAG, which is cleared on read, so, it's
+ * recorded in SYSTICK_WRAPPED.  The second count is long enough
+ * (more than 200ms at 72MHz) for the timer to be programmed again.
+ */
+static uint32_t systick_ticks;	/* Ticks programmed.  */
+static uint8_t systick_wrapped;	/* The count of SYSTICK_TICKS is done.  */
+
 static void
 chx_systick_reset (void)
 {
   *SYST_RVR = 0;
   *SYST_CVR = 0;
   *SYST_CSR = 7;
+  systick_ticks = 0;
+  systick_wrapped = 0;
 }
 
-static void
-chx_systick_reload (uint32_t ticks)
+/* Returns ticks elapsed since SysTick was programmed.  */
+static uint32_t
+chx_systick_get (void)
 {
-  *SYST_RVR = ticks;
-  *SYST_CVR = 0;  /* write (any) to clear the counter to reload.  */
-  *SYST_RVR = 0;
+  uint32_t v = *SYST_CVR;
+
+  if (systick_ticks == 0)
+    return 0;
+
+  if (!systick_wrapped && (*SYST_CSR & SYST_CSR_COUNTFLAG))
+    {
+      systick_wrapped = 1;
+      v = *SYST_CVR;		/* It may have wrapped after the read.  */
+    }
+
+  if (systick_wrapped)
+    return systick_ticks + 1 + SYSTICK_MAX - v;
+  else
+    return systick_ticks - v;
 }
 
+/*
+ * Program SysTick to expire after TICKS.  Returns ticks elapsed since
+ * it was programmed last time.  Interrupts are disabled, so that the
+ * ticks between the read and the reload are constant (a few cycles,
+ * which are not counted).
+ */
 static uint32_t
-chx_systick_get (void)
+chx_systick_reload (uint32_t ticks)
 {
-  return *SYST_CVR;
+  uint32_t primask;
+  uint32_t elapsed;
+
+  /* Reload value of zero doesn't count.  */
+  if (ticks < 2)
+    ticks = 2;
+
+  asm volatile ("mrs	%0, PRIMASK\n\t"
+		"cpsid	i" : "=r" (primask) : /* no input */ : "memory");
+  elapsed = chx_systick_get ();
+  *SYST_RVR = ticks - 1;
+  *SYST_CVR = 0;  /* write (any) to clear the counter to reload.  */
+  *SYST_RVR = SYSTICK_MAX;
+  systick_ticks = ticks;
+  systick_wrapped = 0;
+  asm volatile ("msr	PRIMASK, %0" : : "r" (primask) : "memory");
+  return elapsed;
 }
 
-static uint32_t usec_to_ticks (uint32_t usec)
+static uint64_t usec_to_ticks (uint32_t usec)
 {
-  return usec * MHZ;
+  return (uint64_t)usec * MHZ;
 }
 
 /*
@@ -251,6 +302,7 @@ chx_handle_intr (void)
 		"sub	%0, #16"   /* Exception # - 16 = interrupt number.  */
 		: "=r" (irq_num) : /* no input */ : "memory");
 
+  chx_trace (CHOPSTX_TRACE_INTR, running, irq_num, NULL);
   chx_disable_intr (irq_num);
   chx_spin_lock (&q_intr.lock);
   for (p = q_intr.q.next; p != (struct chx_pq *)&q_intr.q; p = p->next)
@@ -266,6 +318,15 @@ chx_handle_intr (void)
   chx_spin_unlock (&q_intr.lock);
 }
 
+#if defined(CHX_STACK_HIGHWATER)
+static void
+chx_stack_report (struct chx_thread *tp)
+{
+  /* No output device.  Application can use chopstx_stack_highwater.  */
+  (void)tp;
+}
+#endif
+
 static void
 chx_init_arch (struct chx_thread *tp)
 {
@@ -357,20 +418,11 @@ chx_sched (uint32_t yield)
        : "0" (yield)
        : "r2", "r3", "r4", "r5", "r6", "r7", "memory");
 
+  chx_stats_switch (tp, !arg_yield);
   if (arg_yield)
-    {
-      if (tp->flag_sched_rr)
-	chx_timer_dequeue (tp);
-      chx_ready_enqueue (tp);
-    }
+    chx_ready_enqueue (tp);
 
   tp = chx_ready_pop ();
-  if (tp && tp->flag_sched_rr)
-    {
-      chx_spin_lock (&q_timer.lock);
-      tp = chx_timer_insert (tp, PREEMPTION_USEC);
-      chx_spin_unlock (&q_timer.lock);
-    }
 
   asm volatile (/* Now, r0 points to the thread to be switched.  */
 		/* Put it to *running.  */
@@ -480,6 +532,10 @@ chopstx_create_arch (uintptr_t stack_addr, size_t stack_size,
   if (stack_size < sizeof (struct chx_thread) + 8 * sizeof (uint32_t))
     chx_fatal (CHOPSTX_ERR_THREAD_CREATE);
 
+#if defined(CHX_STACK_HIGHWATER)
+  chx_stack_paint (stack_addr, stack_size);
+#endif
+
   stack = (void *)(stack_addr + stack_size - sizeof (struct chx_thread)
 		   - sizeof (struct chx_stack_regs));
   memset (stack, 0, sizeof (struct chx_stack_regs));
@@ -522,7 +578,7 @@ preempt (void)
 
   if (!cur)
     /* It's idle thread.  It's ok to clobber registers.  */
-    ;
+    chx_stats_switch (NULL, 0);
   else
     {
       /* Save registers onto CHX_THREAD struct.  */
@@ -544,21 +600,14 @@ preempt (void)
 	   */
 	: "r2", "r3", "r4", "r5", "r6", "r7", "memory");
 
+      chx_stats_switch (tp, 0);
       if (tp)
 	{
-	  if (tp->flag_sched_rr)
-	    {
-	      if (tp->state == THREAD_RUNNING)
-		{
-		  chx_timer_dequeue (tp);
-		  chx_ready_enqueue (tp);
-		}
-	      /*
-	       * It may be THREAD_READY after chx_timer_expired.
-	       * Then, do nothing.
-	       */
-	    }
-	  else
+	  /*
+	   * It may be THREAD_READY after expiry of its time slice by
+	   * chx_timer_expired.  Then, do nothing.
+	   */
+	  if (tp->state == THREAD_RUNNING)
 	    chx_ready_push (tp);
 	  running = NULL;
 	}
@@ -567,12 +616,6 @@ preempt (void)
   /* Registers on stack (PSP): r0, r1, r2, r3, r12, lr, pc, xpsr */
 
   tp = chx_ready_pop ();
-  if (tp && tp->flag_sched_rr)
-    {
-      chx_spin_lock (&q_timer.lock);
-      tp = chx_timer_insert (tp, PREEMPTION_USEC);
-      chx_spin_unlock (&q_timer.lock);
-    }
 
   asm volatile (
     ".L_CONTEXT_SWITCH:\n\t"
@@ -680,21 +723,14 @@ svc (void)
        : /* no input */
        : "r2", "r3", "r4", "r5", "r6", "memory");
 
+  chx_stats_switch (tp, !orig_r0);
   if (orig_r0)			/* yield */
     {
-      if (tp->flag_sched_rr)
-	chx_timer_dequeue (tp);
       chx_ready_enqueue (tp);
       running = NULL;
     }
 
   tp = chx_ready_pop ();
-  if (tp && tp->flag_sched_rr)
-    {
-      chx_spin_lock (&q_timer.lock);
-      chx_timer_insert (tp, PREEMPTION_USEC);
-      chx_spin_unlock (&q_timer.lock);
-    }
 
   asm volatile (
 	"cbz	r0, 0f\n\t"
@@ -30,50 +30,128 @@
 #include <unistd.h>
 #include <ucontext.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <time.h>
+#if defined(CHX_STACK_HIGHWATER) || defined(CHX_TRACE)
+#include <stdio.h>
+#endif
 
-static sigset_t ss_cur;
+/*
+ * SYSTICK is emulated by a POSIX timer on CLOCK_MONOTONIC, which
+ * delivers SIGALRM.  Ticks are converted to/from nanoseconds.
+ *
+ * The timer is programmed by absolute time, computed from the time
+ * of last chx_systick_get, because chx_systick_reload gets it just
+ * before programming.  When the timer has already expired, it's the
+ * time of the expiry (as if SYSTICK stopped at zero).  Thus, neither
+ * time for reprogramming nor latency of signal delivery causes drift
+ * of the clock.
+ */
+static timer_t systick;
+static uint64_t systick_now;	/* Nanoseconds of last chx_systick_get.  */
+static uint64_t systick_expiry;	/* Nanoseconds when the timer expires.  */
+static uint32_t systick_ticks;	/* Ticks programmed.  */
 
-static void
-chx_systick_reset (void)
+static uint64_t
+clock_nsec (void)
 {
-  const struct itimerval it = { {0, 0}, {0, 0} };
+  struct timespec ts;
 
-  setitimer (ITIMER_REAL, &it, 0);
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 static void
-chx_systick_reload (uint32_t ticks)
+chx_systick_reset (void)
 {
-  struct itimerval it;
+  const struct itimerspec it = { {0, 0}, {0, 0} };
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = (ticks / MHZ);
-  it.it_interval.tv_sec = 0;
-  it.it_interval.tv_usec = 0;
-
-  setitimer (ITIMER_REAL, &it, 0);
+  timer_settime (systick, 0, &it, NULL);
+  systick_expiry = 0;
+  systick_ticks = 0;
 }
 
+/* Returns ticks elapsed since the timer was programmed.  */
 static uint32_t
 chx_systick_get (void)
 {
-  struct itimerval it;
-  getitimer (ITIMER_REAL, &it);
-  return it.it_value.tv_usec * 72;
+  uint64_t now = clock_nsec ();
+  uint32_t remain;
+
+  if (systick_expiry && systick_expiry <= now)
+    {
+      systick_now = systick_expiry;
+      return systick_ticks;
+    }
+
+  systick_now = now;
+  if (systick_expiry == 0)
+    return 0;
+
+  remain = (uint32_t)((systick_expiry - now) * MHZ / 1000);
+  /* It may be larger than programmed, by rounding.  */
+  if (remain > systick_ticks)
+    return 0;
+  return systick_ticks - remain;
 }
 
+/*
+ * Program the timer to expire after TICKS.  Returns ticks elapsed
+ * since it was programmed last time.
+ */
 static uint32_t
+chx_systick_reload (uint32_t ticks)
+{
+  uint32_t elapsed = chx_systick_get ();
+  struct itimerspec it;
+
+  if (ticks == 0)
+    {
+      chx_systick_reset ();
+      return elapsed;
+    }
+
+  /* Round up, so that it won't expire earlier.  */
+  systick_expiry = systick_now + ((uint64_t)ticks * 1000 + MHZ - 1) / MHZ;
+  systick_ticks = ticks;
+  it.it_value.tv_sec = systick_expiry / 1000000000;
+  it.it_value.tv_nsec = systick_expiry % 1000000000;
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_nsec = 0;
+
+  timer_settime (systick, TIMER_ABSTIME, &it, NULL);
+  return elapsed;
+}
+
+static uint64_t
 usec_to_ticks (uint32_t usec)
 {
-  return usec * MHZ;
+  return (uint64_t)usec * MHZ;
 }
 
 
+/*
+ * Interrupt is emulated by signal.
+ *
+ * Schedule lock is implemented by the flag SCHED_LOCKED, instead of
+ * signal mask, so that no system call is needed.  When a signal
+ * comes while it's locked (or its interrupt is disabled), the signal
+ * handler just records it to INTR_PENDING and returns.  Recorded
+ * ones are handled by chx_cpu_sched_unlock later.
+ *
+ * Signal handler should be registered with SA_NODEFER and empty
+ * sa_mask, so that the signal mask is kept intact, even when the
+ * handler switches the context to another thread.
+ */
+#define INTR_BIT(irq_num) ((uint64_t)1 << ((irq_num) - 1))
+
+static volatile sig_atomic_t sched_locked;
+static uint64_t intr_enabled;
+static uint64_t intr_pending;
+
 static void
 chx_enable_intr (uint8_t irq_num)
 {
-  sigdelset (&ss_cur, irq_num);
+  intr_enabled |= INTR_BIT (irq_num);
 }
 
 static void
@@ -85,7 +163,7 @@ chx_clr_intr (uint8_t irq_num)
 static void
 chx_disable_intr (uint8_t irq_num)
 {
-  sigaddset (&ss_cur, irq_num);
+  intr_enabled &= ~INTR_BIT (irq_num);
 }
 
 static void
@@ -102,30 +180,74 @@ chx_prio_init (void)
 static void
 chx_cpu_sched_lock (void)
 {
-  sigset_t ss;
+  sched_locked = 1;
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+}
 
-  sigfillset (&ss);
-  pthread_sigmask (SIG_BLOCK, &ss, &ss_cur);
+/* Take a pending interrupt which is enabled.  Returns 0 if none.  */
+static uint32_t
+intr_take_pending (void)
+{
+  uint64_t pending = __atomic_load_n (&intr_pending, __ATOMIC_RELAXED);
+
+  pending &= intr_enabled;
+  if (pending == 0)
+    return 0;
+
+  pending &= -pending;
+  __atomic_fetch_and (&intr_pending, ~pending, __ATOMIC_RELAXED);
+  return __builtin_ctzll (pending) + 1;
 }
 
+static void chx_intr_dispatch (uint32_t irq_num);
+
 static void
 chx_cpu_sched_unlock (void)
 {
-  pthread_sigmask (SIG_SETMASK, &ss_cur, NULL);
+  uint32_t irq_num;
+
+  while (1)
+    {
+      while ((irq_num = intr_take_pending ()))
+	chx_intr_dispatch (irq_num);
+
+      __atomic_signal_fence (__ATOMIC_SEQ_CST);
+      sched_locked = 0;
+      __atomic_signal_fence (__ATOMIC_SEQ_CST);
+
+      /* Check again, for a signal just before unlocking.  */
+      if ((__atomic_load_n (&intr_pending, __ATOMIC_RELAXED)
+	   & intr_enabled) == 0)
+	break;
+
+      sched_locked = 1;
+      __atomic_signal_fence (__ATOMIC_SEQ_CST);
+    }
 }
 
 static void
 idle (void)
 {
+  /* It starts with schedule lock held.  */
+  chx_cpu_sched_unlock ();
   for (;;)
     pause ();
 }
 
-void
-chx_handle_intr (uint32_t irq_num)
+/* Handle the interrupt.  Called with schedule lock held.  */
+static void
+chx_intr_dispatch (uint32_t irq_num)
 {
+  extern void chx_timer_expired (void);
   struct chx_pq *p;
 
+  if (irq_num == SIGALRM)
+    {
+      chx_timer_expired ();
+      return;
+    }
+
+  chx_trace (CHOPSTX_TRACE_INTR, running, irq_num, NULL);
   chx_disable_intr (irq_num);
   chx_spin_lock (&q_intr.lock);
   for (p = q_intr.q.next; p != (struct chx_pq *)&q_intr.q; p = p->next)
@@ -142,47 +264,224 @@ chx_handle_intr (uint32_t irq_num)
   chx_spin_unlock (&q_intr.lock);
 }
 
+/* Called from signal handler.  */
+void
+chx_handle_intr (uint32_t irq_num)
+{
+  if (sched_locked || (intr_enabled & INTR_BIT (irq_num)) == 0)
+    {
+      __atomic_fetch_or (&intr_pending, INTR_BIT (irq_num),
+			 __ATOMIC_RELAXED);
+      return;
+    }
+
+  chx_cpu_sched_lock ();
+  chx_intr_dispatch (irq_num);
+  chx_cpu_sched_unlock ();
+}
+
 
-static ucontext_t idle_tc;
-static char idle_stack[4096];
+static tcontext_t idle_tc;
+static char idle_stack[16384];
 
-struct chx_thread main_thread;
+#if defined(CHX_SWITCH_X86_64)
+/*
+ * chx_switch_context: Switch the context.
+ *
+ * Callee-saved registers (and MXCSR and x87 control word) are pushed
+ * onto the current stack, its stack pointer is stored to *SAVE_SP,
+ * and they are popped from the stack of SP.  No system call is
+ * involved.
+ */
+void chx_switch_context (uintptr_t *save_sp, uintptr_t sp);
+void chx_thread_trampoline (void);
+
+asm (".text\n\t"
+     ".globl	chx_switch_context\n\t"
+     ".hidden	chx_switch_context\n\t"
+     ".type	chx_switch_context, @function\n"
+"chx_switch_context:\n\t"
+     "push	%rbp\n\t"
+     "push	%rbx\n\t"
+     "push	%r12\n\t"
+     "push	%r13\n\t"
+     "push	%r14\n\t"
+     "push	%r15\n\t"
+     "sub	$8, %rsp\n\t"
+     "stmxcsr	(%rsp)\n\t"
+     "fnstcw	4(%rsp)\n\t"
+     "mov	%rsp, (%rdi)\n\t"
+     "mov	%rsi, %rsp\n\t"
+     "ldmxcsr	(%rsp)\n\t"
+     "fldcw	4(%rsp)\n\t"
+     "add	$8, %rsp\n\t"
+     "pop	%r15\n\t"
+     "pop	%r14\n\t"
+     "pop	%r13\n\t"
+     "pop	%r12\n\t"
+     "pop	%rbx\n\t"
+     "pop	%rbp\n\t"
+     "ret\n\t"
+     ".size	chx_switch_context, .-chx_switch_context\n\t"
+     /* Start of a thread: call RBX with R12 and R13.  */
+     ".globl	chx_thread_trampoline\n\t"
+     ".hidden	chx_thread_trampoline\n\t"
+     ".type	chx_thread_trampoline, @function\n"
+"chx_thread_trampoline:\n\t"
+     "mov	%r12, %rdi\n\t"
+     "mov	%r13, %rsi\n\t"
+     "call	*%rbx\n\t"
+     "ud2\n\t"
+     ".size	chx_thread_trampoline, .-chx_thread_trampoline");
 
-void
-chx_sigmask (ucontext_t *uc)
+/*
+ * Build the initial frame for chx_switch_context at the top of the
+ * stack, so that it starts with calling FUNC (ARG0, ARG1).
+ */
+static uintptr_t
+chx_init_context (uintptr_t stack_end, void (*func) (void),
+		  uintptr_t arg0, uintptr_t arg1)
 {
-  /* Modify oldmask to SS_CUR, so that the signal mask will
-   * be set to SS_CUR.
-   *
-   * In user-level, sigset_t is big, but only the first word
-   * is used by the kernel.
-   */
-  memcpy (&uc->uc_sigmask, &ss_cur, sizeof (uint64_t));
+  /* Stack is 16-byte aligned after return to the trampoline.  */
+  uintptr_t *sp = (uintptr_t *)((stack_end & ~(uintptr_t)15) - 8);
+
+  *sp = (uintptr_t)chx_thread_trampoline;	/* Return address */
+  *--sp = 0;					/* RBP */
+  *--sp = (uintptr_t)func;			/* RBX */
+  *--sp = arg0;					/* R12 */
+  *--sp = arg1;					/* R13 */
+  *--sp = 0;					/* R14 */
+  *--sp = 0;					/* R15 */
+  *--sp = 0x037f00001f80;	/* Initial x87 control word and MXCSR.  */
+  return (uintptr_t)sp;
 }
 
+/*
+ * Switch from TP_PREV to TP.  NULL means idle.  The context of idle
+ * is not saved, it starts from the beginning every time.
+ */
+static void
+chx_swap (struct chx_thread *tp_prev, struct chx_thread *tp)
+{
+  uintptr_t sp;
+
+  if (tp == tp_prev)
+    /* Same thread (say, yield with no other ready thread), or idle.  */
+    return;
+
+  if (tp)
+    sp = tp->tc.sp;
+  else
+    sp = chx_init_context ((uintptr_t)idle_stack + sizeof (idle_stack),
+			   idle, 0, 0);
+
+  chx_switch_context (tp_prev ? &tp_prev->tc.sp : &idle_tc.sp, sp);
+}
+#else
+/*
+ * Switch from TP_PREV to TP.  NULL means idle.
+ */
+static void
+chx_swap (struct chx_thread *tp_prev, struct chx_thread *tp)
+{
+  ucontext_t *tcp = tp ? &tp->tc : &idle_tc;
+
+  if (tp_prev)
+    {
+      /*
+       * A signal may come in the middle of swapcontext.  It's OK,
+       * as it is deferred by the schedule lock, which is held by the
+       * condition of chx_sched function and chx_handle_intr.
+       */
+      swapcontext (&tp_prev->tc, tcp);
+    }
+  else if (tp)
+    setcontext (tcp);
+}
+#endif
+
+struct chx_thread main_thread;
+
 static void
 sigalrm_handler (int sig, siginfo_t *siginfo, void *arg)
 {
-  extern void chx_timer_expired (void);
-  ucontext_t *uc = arg;
   (void)sig;
   (void)siginfo;
-  chx_timer_expired ();
-  chx_sigmask (uc);
+  (void)arg;
+  chx_handle_intr (SIGALRM);
+}
+
+#if defined(CHX_STACK_HIGHWATER)
+/*
+ * Report the maximum usage of stack of TP, when it exits, and for
+ * threads alive at exit of the process.
+ */
+static void
+chx_stack_report (struct chx_thread *tp)
+{
+  if (tp->stack_addr)
+    fprintf (stderr, "chopstx: thread %p: stack %zu/%zu bytes used\n",
+	     (void *)tp, chx_stack_used (tp), tp->stack_size);
 }
 
+static void
+chx_stack_report_all (void)
+{
+  struct chx_thread *tp;
+
+  for (tp = thread_list; tp; tp = tp->list_next)
+    chx_stack_report (tp);
+}
+#endif
+
+#if defined(CHX_TRACE)
+/*
+ * Write the trace buffer at exit of the process, to the file named by
+ * the environment variable CHOPSTX_TRACE.
+ */
+static void
+chx_trace_write (void)
+{
+  const char *filename = getenv ("CHOPSTX_TRACE");
+  FILE *f;
+
+  if (filename == NULL || (f = fopen (filename, "wb")) == NULL)
+    return;
+
+  fwrite (&trace, sizeof (trace), 1, f);
+  fclose (f);
+}
+#endif
+
 static void
 chx_init_arch (struct chx_thread *tp)
 {
   struct sigaction sa;
+  struct sigevent sev;
 
-  sigemptyset (&ss_cur);
+  chx_enable_intr (SIGALRM);
 
   sa.sa_sigaction = sigalrm_handler;
-  sigfillset (&sa.sa_mask);
-  sa.sa_flags = SA_SIGINFO|SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO|SA_RESTART|SA_NODEFER;
   sigaction (SIGALRM, &sa, NULL); 
 
+  memset (&sev, 0, sizeof (sev));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGALRM;
+  if (timer_create (CLOCK_MONOTONIC, &sev, &systick) < 0)
+    chx_fatal (CHOPSTX_ERR_THREAD_CREATE);
+
+#if defined(CHX_STACK_HIGHWATER)
+  atexit (chx_stack_report_all);
+#endif
+#if defined(CHX_TRACE)
+  atexit (chx_trace_write);
+#endif
+
+#if defined(CHX_SWITCH_X86_64)
+  (void)tp;
+#else
   getcontext (&idle_tc);
   idle_tc.uc_stack.ss_sp = idle_stack;
   idle_tc.uc_stack.ss_size = sizeof (idle_stack);
@@ -190,72 +489,34 @@ chx_init_arch (struct chx_thread *tp)
   makecontext (&idle_tc, idle, 0);
 
   getcontext (&tp->tc);
+#endif
 }
 
 static void
 chx_request_preemption (uint16_t prio)
 {
   struct chx_thread *tp, *tp_prev;
-  ucontext_t *tcp;
 
   if (running && (uint16_t)running->prio >= prio)
     return;
 
   /* Change the context to another thread with higher priority.  */
   tp = tp_prev = running;
+  chx_stats_switch (tp, 0);
   if (tp)
     {
-      if (tp->flag_sched_rr)
-	{
-	  if (tp->state == THREAD_RUNNING)
-	    {
-	      chx_timer_dequeue (tp);
-	      chx_ready_enqueue (tp);
-	    }
-	}
-      else
+      /*
+       * It may be THREAD_READY after expiry of its time slice.
+       * Then, do nothing.
+       */
+      if (tp->state == THREAD_RUNNING)
 	chx_ready_push (tp);
       running = NULL;
     }
 
   tp = running = chx_ready_pop ();
-  if (tp)
-    {
-      tcp = &tp->tc;
-      if (tp->flag_sched_rr)
-	{
-	  chx_spin_lock (&q_timer.lock);
-	  tp = chx_timer_insert (tp, PREEMPTION_USEC);
-	  chx_spin_unlock (&q_timer.lock);
-	}
-    }
-  else
-    tcp = &idle_tc;
 
-  if (tp_prev)
-    {
-      /*
-       * The swapcontext implementation may reset sigmask in the
-       * middle of its execution, unfortunately.  It is best if
-       * sigmask restore is done at the end of the routine, but we
-       * can't assume that.
-       *
-       * Thus, there might be a race condition with regards to the
-       * user context TCP, if signal mask is cleared and signal comes
-       * in.  To avoid this situation, we block signals.
-       *
-       * We don't need to fill the mask here.  It keeps the condition
-       * of blocking signals before&after swapcontext call.  It is
-       * done by the signal mask for sigaction, the initial creation
-       * of the thread, and the condition of chx_sched function which
-       * mandates holding cpu_sched_lock.
-       */
-      swapcontext (&tp_prev->tc, tcp);
-    }
-  else if (tp)
-    {
-      setcontext (tcp);
-    }
+  chx_swap (tp_prev, tp);
 }
 
 /*
@@ -276,38 +537,18 @@ static uintptr_t
 chx_sched (uint32_t yield)
 {
   struct chx_thread *tp, *tp_prev;
-  uintptr_t v;
-  ucontext_t *tcp;
 
   tp = tp_prev = running;
+  chx_stats_switch (tp, !yield);
   if (yield)
-    {
-      if (tp->flag_sched_rr)
-	chx_timer_dequeue (tp);
-      chx_ready_enqueue (tp);
-    }
+    chx_ready_enqueue (tp);
 
   running = tp = chx_ready_pop ();
-  if (tp)
-    {
-      v = tp->v;
-      if (tp->flag_sched_rr)
-	{
-	  chx_spin_lock (&q_timer.lock);
-	  tp = chx_timer_insert (tp, PREEMPTION_USEC);
-	  chx_spin_unlock (&q_timer.lock);
-	}
-      tcp = &tp->tc;
-    }
-  else
-    {
-      v = 0;
-      tcp = &idle_tc;
-    }
 
-  swapcontext (&tp_prev->tc, tcp);
+  chx_swap (tp_prev, tp);
+  /* Now, this thread is running again.  Its ->V has the result.  */
   chx_cpu_sched_unlock ();
-  return v;
+  return tp_prev->v;
 }
 
 static void __attribute__((__noreturn__))
@@ -327,11 +568,23 @@ chopstx_create_arch (uintptr_t stack_addr, size_t stack_size,
   if (!tp)
     chx_fatal (CHOPSTX_ERR_THREAD_CREATE);
 
+#if defined(CHX_STACK_HIGHWATER)
+  chx_stack_paint (stack_addr, stack_size);
+#endif
+
+#if defined(CHX_SWITCH_X86_64)
   /*
-   * Calling getcontext with sched_lock held, the context is with
-   * signal blocked.  The sigmask will be cleared in chx_thread_start.
+   * The thread starts with sched_lock held, as it is switched to with
+   * that.  It will be unlocked in chx_thread_start.
+   */
+  tp->tc.sp = chx_init_context (stack_addr + stack_size,
+				(void (*)(void))chx_thread_start,
+				(uintptr_t)thread_entry, (uintptr_t)arg);
+#else
+  /*
+   * The thread starts with sched_lock held, as it is switched to with
+   * that.  It will be unlocked in chx_thread_start.
    */
-  chx_cpu_sched_lock ();
   getcontext (&tp->tc);
   tp->tc.uc_stack.ss_sp = (void *)stack_addr;
   tp->tc.uc_stack.ss_size = stack_size;
@@ -339,6 +592,6 @@ chopstx_create_arch (uintptr_t stack_addr, size_t stack_size,
 
   makecontext (&tp->tc, (void (*)(void))chx_thread_start,
 	       4, thread_entry, arg);
-  chx_cpu_sched_unlock ();
+#endif
   return tp;
 }
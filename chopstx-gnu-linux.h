@@ -1,3 +1,22 @@
+#if defined(__x86_64__) && !defined(CHX_USE_UCONTEXT)
+#define CHX_SWITCH_X86_64 1
+/*
+ * The thread context: specific to GNU/Linux on x86-64.
+ *
+ * Callee-saved registers are saved on the stack of the thread by
+ * chx_switch_context, and only its stack pointer is kept here.
+ * Signal mask is not saved, as it's not used for the schedule lock;
+ * the lock is the flag SCHED_LOCKED in chopstx-gnu-linux.c, which is
+ * held on switch, and the signal mask is the same for all threads.
+ *
+ * Define CHX_USE_UCONTEXT to use ucontext_t instead.
+ */
+struct tcontext {
+  uintptr_t sp;
+};
+
+typedef struct tcontext tcontext_t;
+#else
 #include <ucontext.h>
 /*
  * The thread context: specific to GNU/Linux.
@@ -8,3 +27,4 @@
  */
 
 typedef ucontext_t tcontext_t;
+#endif
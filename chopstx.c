@@ -43,13 +43,68 @@
 #define CHX_FLAGS_MAIN 0
 #endif
 
-/* Constant for round robin scheduling.  */
+/* Default time slice for round robin scheduling.  */
 #if !defined(PREEMPTION_USEC)
 #define PREEMPTION_USEC 1000 /* 1ms */
 #endif
 
 #define MAX_PRIO (255+1)
 
+/*
+ * READY queue implementation.
+ *
+ * When CHX_READY_QUEUE_BITMAP is defined, READY queue is implemented
+ * by FIFO queues for each priority, and a bitmap of non-empty queues.
+ * Enqueue/push/pop are done in constant time, regardless of the number
+ * of ready threads.  It costs 2KiB of RAM (on 32-bit machine), so, it
+ * is enabled by default only for emulation on GNU/Linux (define
+ * CHX_NO_READY_QUEUE_BITMAP to disable it).
+ *
+ * Otherwise, READY queue is a single double linked list sorted by
+ * priority.
+ */
+#if !defined(CHX_READY_QUEUE_BITMAP) && !defined(CHX_NO_READY_QUEUE_BITMAP) \
+  && defined(GNU_LINUX_EMULATION)
+#define CHX_READY_QUEUE_BITMAP 1
+#endif
+
+/*
+ * Mutex fast path.
+ *
+ * When CHX_MUTEX_FAST_PATH is defined, uncontended lock/unlock of
+ * mutex is done by atomic compare-and-swap of its owner word, without
+ * schedule lock.  The bit MUTEX_WAITER of owner word is set when some
+ * thread waits for the mutex, so that unlock goes the slow path.  It
+ * requires LDREX/STREX (ARMv7-M) or C11 atomics (GNU/Linux).  Like
+ * semaphore fast path, it's enabled by default only for ARMv7-M.
+ */
+#if !defined(CHX_MUTEX_FAST_PATH) && !defined(CHX_NO_MUTEX_FAST_PATH) \
+  && (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__))
+#define CHX_MUTEX_FAST_PATH 1
+#endif
+
+/*
+ * Semaphore fast path.
+ *
+ * When CHX_SEM_FAST_PATH is defined, chopstx_sem_post without waiter
+ * and chopstx_sem_trywait are done by an atomic operation on the
+ * count, without schedule lock.  Same requirement as mutex fast path.
+ * It's enabled by default only for ARMv7-M; On GNU/Linux emulation,
+ * the schedule lock is only a flag, and it's faster than atomics.
+ */
+#if !defined(CHX_SEM_FAST_PATH) && !defined(CHX_NO_SEM_FAST_PATH) \
+  && (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__))
+#define CHX_SEM_FAST_PATH 1
+#endif
+
+/*
+ * All threads are linked on a list, when some feature needs to
+ * examine them.
+ */
+#if defined(CHX_THREAD_STATS) || defined(CHX_STACK_HIGHWATER)
+#define CHX_THREAD_LIST 1
+#endif
+
 #ifndef MHZ
 #define MHZ 72
 #endif
@@ -90,6 +145,42 @@ struct chx_queue {
 /* READY: priority queue. */
 static struct chx_queue q_ready;
 
+/*
+ * The thread to be popped next from READY queue, kept out of the
+ * queue.  A thread woken up to preempt running thread is put here,
+ * so that the switch to it doesn't need enqueue and dequeue.  Its
+ * priority is higher than or equal to the threads in the queue.
+ */
+static struct chx_thread *q_ready_first;
+
+#if defined(CHX_READY_QUEUE_BITMAP)
+/* FIFO queue for each priority.  */
+static struct chx_qh q_ready_prio[MAX_PRIO];
+
+/* Bit N of ready_map[N/32] is set when Q_READY_PRIO[N] is not empty.
+ * Bit M of ready_map_summary is set when ready_map[M] is not zero.
+ */
+static uint32_t ready_map[MAX_PRIO/32];
+static uint32_t ready_map_summary;
+#endif
+
+/*
+ * Time slice of round robin scheduling.
+ *
+ * Running thread of CHOPSTX_SCHED_RR is not linked to the timer
+ * queue.  Instead, the end of its time slice is kept in SLICE_END,
+ * and the hardware timer is programmed for it, only when it's earlier
+ * than the timer queue.  With CHX_RR_QUANTUM, a thread has its own
+ * slice, and a thread preempted by a thread of higher priority keeps
+ * the rest of its slice in ->SLICE_LEFT.  The slice is refilled when
+ * the thread is put at the tail of READY queue (on expiry of the
+ * slice, yield, or wakeup).  Without CHX_RR_QUANTUM, the slice is
+ * PREEMPTION_USEC, and a preempted thread goes to the tail with a new
+ * slice.
+ */
+static struct chx_thread *slice_tp; /* Running thread of RR, or NULL.  */
+static uint32_t slice_end;	    /* Ticks of the end of its slice.  */
+
 /* Queue of threads waiting for timer.  */
 static struct chx_queue q_timer;
 
@@ -99,11 +190,45 @@ static struct chx_queue q_join;
 /* Queue of threads which wait for some interrupts.  */
 static struct chx_queue q_intr;
 
+#if defined(CHX_THREAD_LIST)
+/* List of all threads.  */
+static struct chx_thread *thread_list;
+#endif
+
+#if defined(CHX_TRACE)
+/* Scheduler trace.  */
+static struct chopstx_trace trace = {
+  CHOPSTX_TRACE_MAGIC, sizeof (struct chopstx_trace_record),
+  CHX_TRACE_SIZE, MHZ, 0, 1, 0, { { 0, 0, 0, 0, 0, 0 } }
+};
+#endif
+
 /* Forward declaration(s). */
 static void chx_request_preemption (uint16_t prio);
 static int chx_wakeup (struct chx_pq *p);
-static struct chx_thread * chx_timer_insert (struct chx_thread *tp, uint32_t usec);
 static void chx_timer_dequeue (struct chx_thread *tp);
+static uint16_t chx_swtimer_fire (chopstx_timer_t *expired, uint16_t prio);
+#if defined(CHX_CPU_BUDGET)
+static void chx_budget_init (void);
+static void chx_budget_switch (struct chx_thread *tp);
+static uint16_t chx_budget_detach (struct chx_budget *budget);
+#else
+#define chx_budget_init()
+#define chx_budget_switch(tp)
+#endif
+static void chx_slice_switch (struct chx_thread *tp);
+static void chx_ready_enqueue (struct chx_thread *tp);
+#if defined(CHX_THREAD_STATS)
+static void chx_stats_switch (struct chx_thread *tp, int voluntary);
+#else
+#define chx_stats_switch(tp,voluntary)
+#endif
+#if defined(CHX_TRACE)
+static void chx_trace (uint8_t event, struct chx_thread *tp, uint16_t arg,
+		       void *obj);
+#else
+#define chx_trace(event,tp,arg,obj)
+#endif
 
 
 
@@ -142,7 +267,8 @@ struct chx_px {			/* inherits PQ */
   uint32_t                  : 5;
   uint32_t                  : 6;
   uint32_t flag_is_proxy    : 1;
-  uint32_t                  : 8;
+  uint32_t flag_in_pollset  : 1; /* Part of chopstx_pollset_entry_t.  */
+  uint32_t                  : 7;
   uint32_t prio             : 8;
   struct chx_qh *parent;
   uintptr_t v;
@@ -152,6 +278,14 @@ struct chx_px {			/* inherits PQ */
   struct chx_spinlock lock;	/* spinlock to update the COUNTER */
 };
 
+/* The proxy of chopstx_pollset_entry_t is stored in its PX.  */
+typedef char chx_px_size_check[sizeof (struct chx_px)
+			       <= sizeof (((chopstx_pollset_entry_t *)0)->px)
+			       ? 1 : -1];
+
+static void chx_proxy_init (struct chx_px *px, uint32_t *cp);
+static struct chx_thread *chx_proxy_ready (struct chx_px *px);
+
 struct chx_thread {		/* inherits PQ */
   struct chx_pq *next, *prev;
   uint32_t state            : 4;
@@ -160,7 +294,8 @@ struct chx_thread {		/* inherits PQ */
   uint32_t flag_join_req    : 1;
   uint32_t flag_sched_rr    : 1;
   uint32_t flag_cancelable  : 1;
-  uint32_t                  : 6;
+  uint32_t flag_sched_edf   : 1;
+  uint32_t                  : 5;
   uint32_t flag_is_proxy    : 1;
   uint32_t prio_orig        : 8;
   uint32_t prio             : 8;
@@ -169,8 +304,53 @@ struct chx_thread {		/* inherits PQ */
   tcontext_t tc;
   struct chx_mtx *mutex_list;
   struct chx_cleanup *clp;
+  uint64_t deadline;		/* Ticks to wake up, on timer queue.  */
+#if defined(CHX_PERIODIC)
+  uint64_t release;		/* Ticks of next periodic release.  */
+#endif
+#if defined(CHX_SCHED_EDF)
+  uint64_t edf_deadline;	/* Ticks of absolute deadline, for EDF.  */
+#endif
+#if defined(CHX_THREAD_STATS)
+  uint64_t run_ticks;		/* Accumulated run time.  */
+#endif
+  /*
+   * 32-bit fields follow 64-bit ones, so that no padding is needed in
+   * between, for any options.  See CHOPSTX_THREAD_SIZE.
+   */
+#if defined(CHX_PERIODIC)
+  uint32_t period;		/* Period in usec, or 0.  */
+  uint32_t missed;		/* Number of missed deadlines.  */
+#endif
+#if defined(CHX_SCHED_EDF)
+  uint32_t rel_deadline;	/* Relative deadline in usec, or 0.  */
+#endif
+#if defined(CHX_CPU_BUDGET)
+  struct chx_budget *budget;	/* CPU budget, or NULL.  */
+#endif
+#if defined(CHX_RR_QUANTUM)
+  uint32_t slice;		/* Time slice in ticks, for RR.  */
+  uint32_t slice_left;		/* Rest of the time slice in ticks.  */
+#endif
+#if defined(CHX_THREAD_LIST)
+  struct chx_thread *list_next;	/* List of all threads.  */
+#endif
+#if defined(CHX_THREAD_STATS)
+  uint32_t nvcsw;		/* Switches by sleep.  */
+  uint32_t nivcsw;		/* Switches by preemption.  */
+  uint32_t nwakeup;		/* Wakeups from sleep.  */
+#endif
+#if defined(CHX_STACK_HIGHWATER)
+  uintptr_t stack_addr;		/* Stack, or 0 for the main thread.  */
+  size_t stack_size;
+#endif
 };
 
+#if defined(CHX_SCHED_EDF)
+/* EDF_DEADLINE of a thread with no deadline.  */
+#define EDF_NO_DEADLINE (~(uint64_t)0)
+#endif
+
 
 /*
  * Double linked list handling.
@@ -212,19 +392,6 @@ ll_pop (struct chx_qh *q)
   return ll_dequeue (q->next);
 }
 
-static void
-ll_prio_push (struct chx_pq *pq0, struct chx_qh *q0)
-{
-  struct chx_pq *p;
-
-  for (p = q0->next; p != (struct chx_pq *)q0; p = p->next)
-    if (p->prio <= pq0->prio)
-      break;
-
-  pq0->parent = q0;
-  ll_insert (pq0, (struct chx_qh *)p);
-}
-
 static void
 ll_prio_enqueue (struct chx_pq *pq0, struct chx_qh *q0)
 {
@@ -256,16 +423,164 @@ enum  {
 };
 
 
+/*
+ * Returns 1 when thread A should run before thread B.  Higher
+ * priority runs first.  In a priority band, a thread of
+ * CHOPSTX_SCHED_EDF with earlier absolute deadline runs first.  Other
+ * threads have no deadline (EDF_DEADLINE is all ones), so, they come
+ * after EDF threads in the band, in FIFO order.  Without
+ * CHX_SCHED_EDF, it's by priority only.
+ */
+static int
+thread_before (struct chx_thread *a, struct chx_thread *b)
+{
+  if (a->prio != b->prio)
+    return a->prio > b->prio;
+#if defined(CHX_SCHED_EDF)
+  return a->edf_deadline < b->edf_deadline;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Insert TP to Q in the order of thread_before.  When PUSH is 1, TP
+ * goes before threads which are not before TP (at the head of its
+ * band), or else, after threads which are not after TP (at the tail).
+ * Linear in the number of threads to skip, which are EDF threads of
+ * the band, for the bitmap READY queue.
+ */
+static void
+ready_insert (struct chx_thread *tp, struct chx_qh *q, int push)
+{
+  struct chx_pq *p;
+
+  for (p = q->next; p != (struct chx_pq *)q; p = p->next)
+    if (push ? !thread_before ((struct chx_thread *)p, tp)
+	: thread_before (tp, (struct chx_thread *)p))
+      break;
+
+  tp->parent = q;
+  ll_insert ((struct chx_pq *)tp, (struct chx_qh *)p);
+}
+
+#if defined(CHX_READY_QUEUE_BITMAP)
+static void
+ready_map_set (uint16_t prio)
+{
+  ready_map[prio >> 5] |= (1U << (prio & 0x1f));
+  ready_map_summary |= (1U << (prio >> 5));
+}
+
+static void
+ready_map_clr (uint16_t prio)
+{
+  ready_map[prio >> 5] &= ~(1U << (prio & 0x1f));
+  if (ready_map[prio >> 5] == 0)
+    ready_map_summary &= ~(1U << (prio >> 5));
+}
+
+/* Returns the highest priority of ready threads.  Q_READY should not
+ * be empty.  */
+static uint16_t
+ready_map_highest (void)
+{
+  uint16_t i = 31 - __builtin_clz (ready_map_summary);
+
+  return (i << 5) + 31 - __builtin_clz (ready_map[i]);
+}
+
+/* Remove TP from READY queue.  */
+static void
+ready_remove (struct chx_thread *tp)
+{
+  /* When both links point the head, it's the last one.  */
+  if (tp->next == tp->prev)
+    ready_map_clr (tp->parent - q_ready_prio);
+  ll_dequeue ((struct chx_pq *)tp);
+}
+
+/* Put TP to READY queue, at the tail of its priority.  */
+static void
+ready_enqueue (struct chx_thread *tp)
+{
+  struct chx_qh *q = &q_ready_prio[tp->prio];
+
+  if (tp->flag_sched_edf)
+    ready_insert (tp, q, 0);
+  else
+    {
+      tp->parent = q;
+      ll_insert ((struct chx_pq *)tp, q);
+    }
+  ready_map_set (tp->prio);
+}
+#endif
+
+/* Put TP to READY queue, at the head of its priority.  */
+static void
+ready_push (struct chx_thread *tp)
+{
+#if defined(CHX_READY_QUEUE_BITMAP)
+  ready_insert (tp, &q_ready_prio[tp->prio], 1);
+  ready_map_set (tp->prio);
+#else
+  ready_insert (tp, &q_ready.q, 1);
+#endif
+}
+
+/* Returns 1 when TP is higher than any thread in READY queue.  */
+static int
+ready_preempts (struct chx_thread *tp)
+{
+  if (q_ready_first)
+    return thread_before (tp, q_ready_first);
+#if defined(CHX_READY_QUEUE_BITMAP)
+  return ready_map_summary == 0
+    || thread_before (tp, (struct chx_thread *)
+		      q_ready_prio[ready_map_highest ()].next);
+#else
+  return ll_empty (&q_ready.q)
+    || thread_before (tp, (struct chx_thread *)q_ready.q.next);
+#endif
+}
+
+/* Put Q_READY_FIRST back to READY queue.  */
+static void
+ready_flush (void)
+{
+  if (q_ready_first)
+    {
+      ready_push (q_ready_first);
+      q_ready_first = NULL;
+    }
+}
+
 static struct chx_thread *
 chx_ready_pop (void)
 {
   struct chx_thread *tp;
 
   chx_spin_lock (&q_ready.lock);
-  tp = (struct chx_thread *)ll_pop (&q_ready.q);
+  tp = q_ready_first;
+  if (tp)
+    q_ready_first = NULL;
+#if defined(CHX_READY_QUEUE_BITMAP)
+  else if (ready_map_summary != 0)
+    {
+      tp = (struct chx_thread *)q_ready_prio[ready_map_highest ()].next;
+      ready_remove (tp);
+    }
+#else
+  else
+    tp = (struct chx_thread *)ll_pop (&q_ready.q);
+#endif
   if (tp)
     tp->state = THREAD_RUNNING;
   chx_spin_unlock (&q_ready.lock);
+  chx_slice_switch (tp);
+  chx_budget_switch (tp);
+  chx_trace (CHOPSTX_TRACE_SWITCH, tp, 0, NULL);
 
   return tp;
 }
@@ -274,22 +589,99 @@ chx_ready_pop (void)
 static void
 chx_ready_push (struct chx_thread *tp)
 {
+#if !defined(CHX_RR_QUANTUM)
+  if (tp->flag_sched_rr)
+    {
+      /* The rest of its slice is not kept.  Put it at the tail.  */
+      chx_ready_enqueue (tp);
+      return;
+    }
+#endif
   chx_spin_lock (&q_ready.lock);
   tp->state = THREAD_READY;
-  ll_prio_push ((struct chx_pq *)tp, &q_ready.q);
+  if (q_ready_first && !thread_before (q_ready_first, tp))
+    ready_flush ();
+  ready_push (tp);
   chx_spin_unlock (&q_ready.lock);
 }
 
 
+/* Put TP to READY queue.  Called with Q_READY locked.  */
+static void
+ready_put (struct chx_thread *tp)
+{
+  if (ready_preempts (tp))
+    {
+      /* Direct handoff: TP will be switched to, next.  */
+      ready_flush ();
+      q_ready_first = tp;
+    }
+  else
+#if defined(CHX_READY_QUEUE_BITMAP)
+    ready_enqueue (tp);
+#else
+    ready_insert (tp, &q_ready.q, 0);
+#endif
+}
+
+
 static void
 chx_ready_enqueue (struct chx_thread *tp)
 {
   chx_spin_lock (&q_ready.lock);
+  if (tp->state >= THREAD_WAIT_MTX && tp->state <= THREAD_WAIT_POLL)
+    {
+#if defined(CHX_THREAD_STATS)
+      tp->nwakeup++;
+#endif
+      chx_trace (CHOPSTX_TRACE_WAKEUP, tp, tp->state, NULL);
+    }
   tp->state = THREAD_READY;
-  ll_prio_enqueue ((struct chx_pq *)tp, &q_ready.q);
+#if defined(CHX_RR_QUANTUM)
+  tp->slice_left = tp->slice;
+#endif
+  if (tp == slice_tp)
+    slice_tp = NULL;
+  ready_put (tp);
   chx_spin_unlock (&q_ready.lock);
 }
 
+#if defined(CHX_STACK_HIGHWATER)
+/*
+ * Stack high-water mark.
+ *
+ * Stack of a thread is painted by the pattern when it's created.
+ * Bytes from the bottom of the stack which keep the pattern are the
+ * bytes never used.
+ */
+#define CHX_STACK_PAINT 0xa5a5a5a5
+
+static void
+chx_stack_paint (uintptr_t stack_addr, size_t stack_size)
+{
+  uint32_t *p = (uint32_t *)((stack_addr + 3) & ~3);
+  uint32_t *end = (uint32_t *)(stack_addr + stack_size);
+
+  while (p < end)
+    *p++ = CHX_STACK_PAINT;
+}
+
+/* Returns the maximum bytes used in the stack of TP.  */
+static size_t
+chx_stack_used (struct chx_thread *tp)
+{
+  const uint32_t *p = (const uint32_t *)((tp->stack_addr + 3) & ~3);
+  uintptr_t end = tp->stack_addr + tp->stack_size;
+
+  if (tp->stack_addr == 0)
+    return 0;
+
+  while ((uintptr_t)p < end && *p == CHX_STACK_PAINT)
+    p++;
+  return end - (uintptr_t)p;
+}
+#endif
+
 /*
  * Here comes architecture specific code.
  */
@@ -299,121 +691,516 @@ chx_ready_enqueue (struct chx_thread *tp)
 #else
 #include "chopstx-cortex-m.c"
 #endif
-
+
+/*
+ * Callbacks of software timers without work queue are called by
+ * chx_timer_expired, that is, in interrupt context.  While they run,
+ * preemption requested by *_from_isr functions is deferred to the
+ * end.  On GNU/Linux emulation, it's the only interrupt context where
+ * *_from_isr functions are called.
+ */
+static uint8_t swtimer_in_callback;
+static uint16_t swtimer_prio;
+
 static void
-chx_set_timer (struct chx_thread *tp, uint32_t ticks)
+chx_request_preemption_from_isr (uint16_t prio)
 {
-  if (tp == (struct chx_thread *)&q_timer.q)
-    chx_systick_reload (ticks);
-  else
-    tp->v = ticks;
+  if (!swtimer_in_callback)
+    chx_request_preemption (prio);
+  else if (swtimer_prio < prio)
+    swtimer_prio = prio;
 }
+
+/*
+ * Time base.
+ *
+ * The hardware timer is programmed as one-shot for the earliest
+ * expiry of timer queue.  Current time (in ticks) is computed from
+ * the time when it was programmed and the ticks elapsed since then.
+ * Reprogramming returns the ticks elapsed until then, including the
+ * time after the expiry (say, latency of interrupt), so that no tick
+ * is lost on expiry.  It is extended to 64-bit by software, and the
+ * timer keeps running even if there is no entry in timer queue, so
+ * that it's monotonic.
+ *
+ * The timer queue uses lower 32-bit of ticks.  Comparison of them
+ * should be done by the difference of two values (as signed
+ * integer), so that wrap-around is handled well.
+ */
+static uint64_t timer_base;	/* Ticks when the timer was programmed.  */
 
-static struct chx_thread *
-chx_timer_insert (struct chx_thread *tp, uint32_t usec)
+static uint64_t
+chx_clock_ticks (void)
 {
-  struct chx_pq *p;
-  uint32_t ticks = usec_to_ticks (usec);
-  uint32_t next_ticks = chx_systick_get ();
+  return timer_base + chx_systick_get ();
+}
+
+#if defined(CHX_THREAD_STATS)
+/* Ticks when the context was switched last time.  */
+static uint64_t stats_switch_ticks;
+
+/*
+ * Account the run time of TP (NULL for idle), which is switched out.
+ * VOLUNTARY is 1 when it goes to sleep.  Called with schedule lock
+ * held.
+ */
+static void
+chx_stats_switch (struct chx_thread *tp, int voluntary)
+{
+  uint64_t now = chx_clock_ticks ();
 
-  for (p = q_timer.q.next; p != (struct chx_pq *)&q_timer.q; p = p->next)
+  if (tp)
     {
-      if (ticks < next_ticks)
-	{
-	  tp->parent = &q_timer.q;
-	  ll_insert ((struct chx_pq *)tp, (struct chx_qh *)p);
-	  chx_set_timer ((struct chx_thread *)tp->prev, ticks);
-	  chx_set_timer (tp, (next_ticks - ticks));
-	  break;
-	}
+      tp->run_ticks += now - stats_switch_ticks;
+      if (voluntary)
+	tp->nvcsw++;
       else
-	{
-	  ticks -= next_ticks;
-	  next_ticks = p->v;
-	}
+	tp->nivcsw++;
     }
+  stats_switch_ticks = now;
+}
 
-  if (p == (struct chx_pq *)&q_timer.q)
-    {
-      tp->parent = &q_timer.q;
-      ll_insert ((struct chx_pq *)tp, (struct chx_qh *)p);
-      chx_set_timer ((struct chx_thread *)tp->prev, ticks);
-      chx_set_timer (tp, 1);	/* Non-zero for the last entry. */
-    }
+static void
+chx_stats_init (struct chx_thread *tp)
+{
+  tp->nvcsw = tp->nivcsw = tp->nwakeup = 0;
+  tp->run_ticks = 0;
+}
+#endif
 
-  return tp;
+#if defined(CHX_TRACE)
+/*
+ * Write a record to the trace buffer.  It's called with schedule
+ * lock held, or from interrupt handler masked by schedule lock, so,
+ * no other lock is needed.
+ */
+static void
+chx_trace (uint8_t event, struct chx_thread *tp, uint16_t arg, void *obj)
+{
+  struct chopstx_trace_record *r;
+
+  if (!trace.enabled)
+    return;
+
+  r = &trace.rec[trace.index++ & (CHX_TRACE_SIZE - 1)];
+  r->time = (uint32_t)chx_clock_ticks ();
+  r->event = event;
+  r->prio = tp ? tp->prio : 0;
+  r->arg = arg;
+  r->thd = (uintptr_t)tp;
+  r->obj = (uintptr_t)obj;
 }
+#endif
 
+#if defined(CHX_THREAD_LIST)
+static void
+chx_thread_link (struct chx_thread *tp)
+{
+#if defined(CHX_THREAD_STATS)
+  chx_stats_init (tp);
+#endif
+  tp->list_next = thread_list;
+  thread_list = tp;
+}
 
 static void
-chx_timer_dequeue (struct chx_thread *tp)
+chx_thread_unlink (struct chx_thread *tp)
 {
-  struct chx_thread *tp_prev;
+  struct chx_thread **tpp;
+
+  for (tpp = &thread_list; *tpp; tpp = &(*tpp)->list_next)
+    if (*tpp == tp)
+      {
+	*tpp = tp->list_next;
+	break;
+      }
+}
+#endif
 
-  chx_spin_lock (&q_timer.lock);
-  tp_prev = (struct chx_thread *)tp->prev;
-  if (tp_prev == (struct chx_thread *)&q_timer.q)
-    {
-      if (tp->next == (struct chx_pq *)&q_timer.q)
-	chx_set_timer (tp_prev, 0); /* Cancel timer*/
-      else
-	{			/* Update timer.  */
-	  uint32_t next_ticks = chx_systick_get () + tp->v;
+static uint32_t
+chx_timer_now (void)
+{
+  return (uint32_t)chx_clock_ticks ();
+}
 
-	  chx_set_timer (tp_prev, next_ticks);
-	}
-    }
-  else
-    tp_prev->v += tp->v;
-  ll_dequeue ((struct chx_pq *)tp);
-  tp->v = 0;
-  chx_spin_unlock (&q_timer.lock);
+static void
+chx_timer_program (uint32_t ticks)
+{
+  timer_base += chx_systick_reload (ticks);
 }
 
 
-void
-chx_timer_expired (void)
+/*
+ * Timer queue is implemented by a timing wheel of two levels.
+ *
+ * A thread waiting for timer is linked to a slot of the wheel, by the
+ * absolute expiry ticks in ->V.  A slot covers 2^TIMER_SLOT_SHIFT
+ * ticks.  The entries in the current slot (TIMER_SLOT_CUR) are in the
+ * fine wheel instead, whose slot covers 2^TIMER_FINE_SHIFT ticks and
+ * is sorted by expiry.  When the fine wheel becomes empty, the current
+ * slot advances, and the entries of the new current slot are moved to
+ * the fine wheel.  So, the earliest entry is the first one of the
+ * first non-empty fine slot, which is found by the bitmap.  Insertion
+ * and removal are done in constant time, except the sorted insertion
+ * to a fine slot, which is linear in the entries of the fine slot.
+ * Each entry is moved to the fine wheel at most once.
+ *
+ * When the fine wheel is empty, the hardware timer is programmed for
+ * the start of the first non-empty slot, so that its entries are
+ * moved then.
+ *
+ * All entries should be within TIMER_WHEEL_SIZE slots from
+ * TIMER_SLOT_CUR.  An entry can't be longer than TIMER_MAX_TICKS,
+ * which is the half of the wheel (leaving the other half for latency
+ * of timer processing).  It's also the limit of SYSTICK (24-bit).
+ * When its ->DEADLINE is further, the entry is linked again on
+ * expiry, without waking up the thread.
+ *
+ * A software timer is linked to the wheel as well, and it's
+ * distinguished from a thread by ->FLAG_IS_PROXY.
+ */
+#define TIMER_WHEEL_SIZE 16
+#define TIMER_SLOT_SHIFT 21
+#define TIMER_FINE_SIZE 32
+#define TIMER_FINE_SHIFT (TIMER_SLOT_SHIFT - 5)
+#define TIMER_MAX_TICKS (((TIMER_WHEEL_SIZE / 2) << TIMER_SLOT_SHIFT) - 1)
+
+static struct chx_qh q_timer_slot[TIMER_WHEEL_SIZE];
+static struct chx_qh q_timer_fine[TIMER_FINE_SIZE];
+
+/* Bit N is set when Q_TIMER_SLOT[N] is not empty.  */
+static uint32_t timer_slot_map;
+
+/* Bit N is set when Q_TIMER_FINE[N] is not empty.  */
+static uint32_t timer_fine_map;
+
+/* Start ticks of the current slot, whose entries are in the fine
+ * wheel.  It's not later than the slot of current time.  */
+static uint32_t timer_slot_cur;
+
+/* Expiry of the earliest entry (or the end of time slice), which is
+ * programmed to hardware.  */
+static uint32_t timer_next;
+
+#define TIMER_SLOT(ticks) ((ticks) & ~((1U << TIMER_SLOT_SHIFT) - 1))
+#define TIMER_SLOT_INDEX(ticks) \
+  (((ticks) >> TIMER_SLOT_SHIFT) & (TIMER_WHEEL_SIZE - 1))
+#define TIMER_FINE_INDEX(ticks) \
+  (((ticks) >> TIMER_FINE_SHIFT) & (TIMER_FINE_SIZE - 1))
+
+/* Returns the start ticks of the first non-empty slot.  TIMER_SLOT_MAP
+ * should not be zero.  */
+static uint32_t
+timer_slot_first (void)
 {
-  struct chx_thread *tp;
-  uint16_t prio = 0;			/* Use uint16_t here. */
+  uint32_t i = TIMER_SLOT_INDEX (timer_slot_cur);
+  uint32_t map = ((timer_slot_map >> i)
+		  | (timer_slot_map << (TIMER_WHEEL_SIZE - i)));
 
-  chx_spin_lock (&q_timer.lock);
-  if ((tp = (struct chx_thread *)ll_pop (&q_timer.q)))
-    {
-      uint32_t next_tick = tp->v;
+  return timer_slot_cur + (__builtin_ctz (map) << TIMER_SLOT_SHIFT);
+}
 
-      chx_ready_enqueue (tp);
-      if (tp == running)	/* tp->flag_sched_rr == 1 */
-	prio = MAX_PRIO;
-      else
-	if ((uint16_t)tp->prio > prio)
-	  prio = (uint16_t)tp->prio;
+/* Link P to the fine wheel, after the entries of same or earlier
+ * expiry.  */
+static void
+timer_fine_insert (struct chx_pq *p)
+{
+  uint32_t i = TIMER_FINE_INDEX (p->v);
+  struct chx_qh *q = &q_timer_fine[i];
+  struct chx_pq *p0;
 
-      if (!ll_empty (&q_timer.q))
-	{
-	  struct chx_thread *tp_next;
+  for (p0 = q->prev; p0 != (struct chx_pq *)q; p0 = p0->prev)
+    if ((int32_t)(p0->v - p->v) <= 0)
+      break;
 
-	  for (tp = (struct chx_thread *)q_timer.q.next;
-	       tp != (struct chx_thread *)&q_timer.q && next_tick == 0;
-	       tp = tp_next)
-	    {
-	      next_tick = tp->v;
-	      tp_next = (struct chx_thread *)tp->next;
-	      ll_dequeue ((struct chx_pq *)tp);
-	      chx_ready_enqueue (tp);
-	      if (tp == running)
-		prio = MAX_PRIO;
-	      else
-		if ((uint16_t)tp->prio > prio)
-		  prio = (uint16_t)tp->prio;
+  ll_insert (p, (struct chx_qh *)p0->next);
+  timer_fine_map |= (1U << i);
+}
+
+/*
+ * When the fine wheel is empty, advance the current slot to the slot
+ * of NOW, or to the first non-empty slot if it's earlier, moving its
+ * entries to the fine wheel.
+ */
+static void
+timer_advance (uint32_t now)
+{
+  uint32_t slot = TIMER_SLOT (now);
+
+  while (timer_fine_map == 0 && timer_slot_cur != slot)
+    {
+      struct chx_qh *q;
+      struct chx_pq *p;
+      uint32_t first;
+
+      if (timer_slot_map == 0)
+	{
+	  timer_slot_cur = slot;
+	  break;
+	}
+
+      first = timer_slot_first ();
+      if ((int32_t)(first - slot) > 0)
+	{
+	  timer_slot_cur = slot;
+	  break;
+	}
+
+      timer_slot_cur = first;
+      q = &q_timer_slot[TIMER_SLOT_INDEX (first)];
+      while ((p = ll_pop (q)))
+	timer_fine_insert (p);
+      timer_slot_map &= ~(1U << TIMER_SLOT_INDEX (first));
+    }
+}
+
+/* Program the hardware timer for the earliest entry.  */
+static void
+timer_program_next (uint32_t now)
+{
+  uint32_t next;
+
+  timer_advance (now);
+  if (timer_fine_map)
+    next = q_timer_fine[__builtin_ctz (timer_fine_map)].next->v;
+  else if (timer_slot_map)
+    /* Move the entries to the fine wheel at the start of the slot.  */
+    next = timer_slot_first ();
+  else
+    /* Keep the timer running for the clock.  */
+    next = now + TIMER_MAX_TICKS;
+
+  if (slice_tp && (int32_t)(slice_end - next) < 0)
+    next = slice_end;
+
+  timer_next = next;
+  if ((int32_t)(next - now) <= 0)
+    chx_timer_program (1);
+  else
+    chx_timer_program (next - now);
+}
+
+static void
+timer_remove (struct chx_pq *p)
+{
+  /* When both links point the head, it's the last one.  */
+  if (p->next == p->prev)
+    {
+      if (TIMER_SLOT (p->v) == timer_slot_cur)
+	timer_fine_map &= ~(1U << TIMER_FINE_INDEX (p->v));
+      else
+	timer_slot_map &= ~(1U << TIMER_SLOT_INDEX (p->v));
+    }
+  ll_dequeue (p);
+  p->parent = NULL;
+}
+
+/*
+ * Link P to the wheel, for DEADLINE.  Returns ticks to program the
+ * hardware timer when it's the earliest, otherwise 0.
+ */
+static uint32_t
+timer_link (struct chx_pq *p, uint64_t deadline, uint64_t now64)
+{
+  uint32_t now = (uint32_t)now64;
+  uint32_t ticks, expiry, r = 0;
+
+  if ((int64_t)(deadline - now64) <= 0)
+    ticks = 0;
+  else if (deadline - now64 > TIMER_MAX_TICKS)
+    ticks = TIMER_MAX_TICKS;
+  else
+    ticks = (uint32_t)(deadline - now64);
+
+  timer_advance (now);
+
+  expiry = now + ticks;
+  p->v = expiry;
+  p->parent = &q_timer.q;
+  if (TIMER_SLOT (expiry) == timer_slot_cur)
+    timer_fine_insert (p);
+  else
+    {
+      uint32_t i = TIMER_SLOT_INDEX (expiry);
+
+      ll_insert (p, &q_timer_slot[i]);
+      timer_slot_map |= (1U << i);
+    }
+
+  if ((int32_t)(expiry - timer_next) < 0)
+    {
+      timer_next = expiry;
+      r = ticks ? ticks : 1;
+    }
+
+  return r;
+}
+
+/* Let TP sleep until DEADLINE (in ticks).  */
+static struct chx_thread *
+chx_timer_insert_until (struct chx_thread *tp, uint64_t deadline)
+{
+  uint32_t ticks;
+
+  tp->deadline = deadline;
+  ticks = timer_link ((struct chx_pq *)tp, deadline, chx_clock_ticks ());
+  if (ticks)
+    chx_timer_program (ticks);
+
+  return tp;
+}
+
+#if defined(CHX_RR_QUANTUM)
+#define SLICE_LEFT(tp) ((tp)->slice_left)
+#else
+#define SLICE_LEFT(tp) ((uint32_t)usec_to_ticks (PREEMPTION_USEC))
+#endif
+
+/*
+ * Switch the time slice to TP (NULL for idle).  The rest of the slice
+ * of previous thread is kept.  Called by chx_ready_pop, with schedule
+ * lock held.
+ */
+static void
+chx_slice_switch (struct chx_thread *tp)
+{
+  uint32_t now;
+
+  if (slice_tp == NULL && (tp == NULL || !tp->flag_sched_rr))
+    return;
+
+  now = chx_timer_now ();
+  if (slice_tp)
+    {
+#if defined(CHX_RR_QUANTUM)
+      int32_t left = (int32_t)(slice_end - now);
+
+      slice_tp->slice_left = left > 0 ? (uint32_t)left : 1;
+#endif
+      slice_tp = NULL;
+    }
+
+  if (tp && tp->flag_sched_rr)
+    {
+      slice_tp = tp;
+      slice_end = now + SLICE_LEFT (tp);
+      chx_spin_lock (&q_timer.lock);
+      if ((int32_t)(slice_end - timer_next) < 0)
+	{
+	  timer_next = slice_end;
+	  chx_timer_program (SLICE_LEFT (tp));
+	}
+      chx_spin_unlock (&q_timer.lock);
+    }
+}
+
+#if defined(CHX_RR_QUANTUM)
+/* Time slice in ticks, by the flags of chopstx_create.  */
+static uint32_t
+chx_slice_ticks (uint32_t flags)
+{
+  uint32_t msec = (flags >> CHOPSTX_QUANTUM_SHIFT) & 0xff;
+  uint64_t ticks;
+
+  if (msec == 0)
+    ticks = usec_to_ticks (PREEMPTION_USEC);
+  else
+    ticks = usec_to_ticks (msec * 1000);
+
+  return ticks > TIMER_MAX_TICKS ? TIMER_MAX_TICKS : (uint32_t)ticks;
+}
+#endif
+
+
+static void
+chx_timer_dequeue (struct chx_thread *tp)
+{
+  chx_spin_lock (&q_timer.lock);
+  if (tp->parent == &q_timer.q)
+    {
+      uint32_t expiry = tp->v;
+
+      timer_remove ((struct chx_pq *)tp);
+      if (expiry == timer_next)
+	timer_program_next (chx_timer_now ());
+    }
+  tp->v = 0;
+  chx_spin_unlock (&q_timer.lock);
+}
+
+
+void
+chx_timer_expired (void)
+{
+  struct chx_thread *tp;
+  chopstx_timer_t *expired = NULL;
+  uint16_t prio = 0;			/* Use uint16_t here. */
+  uint64_t now64;
+  uint32_t now;
+
+  chx_trace (CHOPSTX_TRACE_TIMER, running, 0, NULL);
+  chx_spin_lock (&q_timer.lock);
+  now64 = chx_clock_ticks ();
+  now = (uint32_t)now64;
+  for (;;)
+    {
+      struct chx_pq *p;
+
+      timer_advance (now);
+      if (timer_fine_map == 0)
+	break;
+
+      p = q_timer_fine[__builtin_ctz (timer_fine_map)].next;
+      if ((int32_t)(p->v - now) > 0)
+	break;
+
+      timer_remove (p);
+      if (p->flag_is_proxy)
+	{			/* Software timer.  */
+	  chopstx_timer_t *timer = (chopstx_timer_t *)p;
+
+	  if ((int64_t)(timer->deadline - now64) <= 0)
+	    {
+	      /* Fire it later, as it may change the queue.  */
+	      timer->next = expired;
+	      expired = timer;
+	      if (timer->period == 0)
+		continue;
+	      do
+		timer->deadline += timer->period;
+	      while ((int64_t)(timer->deadline - now64) <= 0);
 	    }
+	  timer_link (p, timer->deadline, now64);
+	  continue;
+	}
 
-	  if (!ll_empty (&q_timer.q))
-	    chx_set_timer ((struct chx_thread *)&q_timer.q, next_tick);
+      tp = (struct chx_thread *)p;
+      if ((int64_t)(tp->deadline - now64) > 0)
+	{			/* Not yet, link it again.  */
+	  timer_link (p, tp->deadline, now64);
+	  continue;
 	}
+
+      tp->v = 0;
+      chx_ready_enqueue (tp);
+      if (tp->flag_sched_edf && running && thread_before (tp, running))
+	prio = MAX_PRIO;	/* Earlier deadline in the band.  */
+      else
+	if ((uint16_t)tp->prio > prio)
+	  prio = (uint16_t)tp->prio;
+    }
+
+  if (slice_tp && (int32_t)(slice_end - now) <= 0)
+    {
+      /* Time slice of running thread is over.  */
+      chx_ready_enqueue (slice_tp);
+      prio = MAX_PRIO;
     }
 
+  timer_program_next (now);
   chx_spin_unlock (&q_timer.lock);
+  if (expired)
+    prio = chx_swtimer_fire (expired, prio);
   chx_request_preemption (prio);
 }
 
@@ -423,14 +1210,16 @@ chx_systick_init (void)
 {
   chx_systick_reset ();
 
-  if ((CHX_FLAGS_MAIN & CHOPSTX_SCHED_RR))
+  chx_cpu_sched_lock ();
+  chx_spin_lock (&q_timer.lock);
+  if (running->flag_sched_rr)
     {
-      chx_cpu_sched_lock ();
-      chx_spin_lock (&q_timer.lock);
-      chx_timer_insert (running, PREEMPTION_USEC);
-      chx_spin_unlock (&q_timer.lock);
-      chx_cpu_sched_unlock ();
+      slice_tp = running;
+      slice_end = chx_timer_now () + SLICE_LEFT (running);
     }
+  timer_program_next (0);	/* Start the clock.  */
+  chx_spin_unlock (&q_timer.lock);
+  chx_cpu_sched_unlock ();
 }
 
 chopstx_t chopstx_main;
@@ -443,12 +1232,32 @@ chx_init (struct chx_thread *tp)
 
   q_ready.q.next = q_ready.q.prev = (struct chx_pq *)&q_ready.q;
   chx_spin_init (&q_ready.lock);
+#if defined(CHX_READY_QUEUE_BITMAP)
+  {
+    int i;
+
+    for (i = 0; i < MAX_PRIO; i++)
+      q_ready_prio[i].next = q_ready_prio[i].prev
+	= (struct chx_pq *)&q_ready_prio[i];
+  }
+#endif
   q_timer.q.next = q_timer.q.prev = (struct chx_pq *)&q_timer.q;
   chx_spin_init (&q_timer.lock);
+  {
+    int i;
+
+    for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+      q_timer_slot[i].next = q_timer_slot[i].prev
+	= (struct chx_pq *)&q_timer_slot[i];
+    for (i = 0; i < TIMER_FINE_SIZE; i++)
+      q_timer_fine[i].next = q_timer_fine[i].prev
+	= (struct chx_pq *)&q_timer_fine[i];
+  }
   q_join.q.next = q_join.q.prev = (struct chx_pq *)&q_join.q;
   chx_spin_init (&q_join.lock);
   q_intr.q.next = q_intr.q.prev = (struct chx_pq *)&q_intr.q;
   chx_spin_init (&q_intr.lock);
+  chx_budget_init ();
   tp->next = tp->prev = (struct chx_pq *)tp;
   tp->mutex_list = NULL;
   tp->clp = NULL;
@@ -456,12 +1265,38 @@ chx_init (struct chx_thread *tp)
   tp->flag_got_cancel = tp->flag_join_req = 0;
   tp->flag_cancelable = 1;
   tp->flag_sched_rr = (CHX_FLAGS_MAIN & CHOPSTX_SCHED_RR)? 1 : 0;
+#if defined(CHX_RR_QUANTUM)
+  tp->slice = tp->slice_left = chx_slice_ticks (CHX_FLAGS_MAIN);
+#endif
+#if defined(CHX_SCHED_EDF)
+  tp->flag_sched_edf = (CHX_FLAGS_MAIN & CHOPSTX_SCHED_EDF)? 1 : 0;
+#else
+  tp->flag_sched_edf = 0;
+#endif
   tp->flag_detached = (CHX_FLAGS_MAIN & CHOPSTX_DETACHED)? 1 : 0;
   tp->flag_is_proxy = 0;
   tp->prio_orig = CHX_PRIO_MAIN_INIT;
   tp->prio = 0;
   tp->parent = NULL;
   tp->v = 0;
+#if defined(CHX_PERIODIC)
+  tp->release = 0;
+  tp->period = tp->missed = 0;
+#endif
+#if defined(CHX_SCHED_EDF)
+  tp->edf_deadline = EDF_NO_DEADLINE;
+  tp->rel_deadline = 0;
+#endif
+#if defined(CHX_CPU_BUDGET)
+  tp->budget = NULL;
+#endif
+#if defined(CHX_STACK_HIGHWATER)
+  tp->stack_addr = 0;
+  tp->stack_size = 0;
+#endif
+#if defined(CHX_THREAD_LIST)
+  chx_thread_link (tp);
+#endif
   running = tp;
 
   if (CHX_PRIO_MAIN_INIT >= CHOPSTX_PRIO_INHIBIT_PREEMPTION)
@@ -490,14 +1325,12 @@ chx_wakeup (struct chx_pq *pq)
       struct chx_px *px = (struct chx_px *)pq;
 
       chx_spin_lock (&px->lock);
-      (*px->counter_p)++;
-      *px->ready_p = 1;
-      tp = px->master;
-      if (tp->state == THREAD_WAIT_POLL)
+      tp = chx_proxy_ready (px);
+      if (tp && tp->state == THREAD_WAIT_POLL)
 	{
-	  tp->v = (uintptr_t)1;
 	  if (tp->parent == &q_timer.q)
 	    chx_timer_dequeue (tp);
+	  tp->v = (uintptr_t)1;
 	  chx_ready_enqueue (tp);
 	  if (!running || tp->prio > running->prio)
 	    yield = 1;
@@ -537,10 +1370,16 @@ chx_exit (void *retval)
       chx_spin_unlock (&q_join.lock);
     }
 
-  if (running->flag_sched_rr)
-    chx_timer_dequeue (running);
+#if defined(CHX_STACK_HIGHWATER)
+  chx_stack_report (running);
+#endif
   if (running->flag_detached)
-    running->state = THREAD_FINISHED;
+    {
+#if defined(CHX_THREAD_LIST)
+      chx_thread_unlink (running);
+#endif
+      running->state = THREAD_FINISHED;
+    }
   else
     running->state = THREAD_EXITED;
   running->v = (uintptr_t)retval;
@@ -550,6 +1389,64 @@ chx_exit (void *retval)
 }
 
 
+#if defined(CHX_MUTEX_FAST_PATH)
+#define MUTEX_WAITER ((uintptr_t)1)
+#define MUTEX_OWNER(m) \
+  ((struct chx_thread *)((uintptr_t)(m)->owner & ~MUTEX_WAITER))
+#else
+#define MUTEX_OWNER(m) ((m)->owner)
+#endif
+
+#if defined(CHX_MUTEX_PROFILE)
+/*
+ * Contention profile of mutexes.
+ *
+ * All mutexes are linked on the list at chopstx_mutex_init, so, a
+ * mutex should not go away (e.g. on stack) while profiling.
+ */
+static chopstx_mutex_t *mutex_prof_list;
+
+static void
+chx_mutex_profile_init (chopstx_mutex_t *mutex)
+{
+  chopstx_mutex_t *m;
+
+  mutex->acquired = mutex->contended = mutex->boosted = 0;
+  mutex->wait_total = mutex->wait_max = 0;
+
+  chx_cpu_sched_lock ();
+  for (m = mutex_prof_list; m; m = m->prof_next)
+    if (m == mutex)
+      break;
+  if (m == NULL)
+    {			/* Not yet linked (it may be initialized again).  */
+      mutex->prof_next = mutex_prof_list;
+      mutex_prof_list = mutex;
+    }
+  chx_cpu_sched_unlock ();
+}
+
+/*
+ * Account an acquisition of MUTEX.  When it waited, WAIT_START is the
+ * ticks when it started to wait.  Called with MUTEX held.
+ */
+static void
+chx_mutex_profile_acquired (chopstx_mutex_t *mutex, int waited,
+			    uint64_t wait_start)
+{
+  mutex->acquired++;
+  if (waited)
+    {
+      uint64_t wait = chx_clock_ticks () - wait_start;
+
+      mutex->contended++;
+      mutex->wait_total += wait;
+      if (mutex->wait_max < wait)
+	mutex->wait_max = wait;
+    }
+}
+#endif
+
 /*
  * Lower layer mutex unlocking.  Called with schedule lock held.
  */
@@ -570,6 +1467,11 @@ chx_mutex_unlock (chopstx_mutex_t *mutex)
       chopstx_mutex_t *m;
 
       chx_ready_enqueue (tp);
+#if defined(CHX_MUTEX_FAST_PATH)
+      /* Keep the others from locking by the fast path.  */
+      if (!ll_empty (&mutex->q))
+	mutex->owner = (struct chx_thread *)MUTEX_WAITER;
+#endif
 
       /* Examine mutexes we hold, and determine new priority for running.  */
       for (m = running->mutex_list; m; m = m->list)
@@ -608,6 +1510,10 @@ chopstx_create (uint32_t flags_and_prio,
 
   tp = chopstx_create_arch (stack_addr, stack_size, thread_entry,
 			    arg);
+#if defined(CHX_STACK_HIGHWATER)
+  tp->stack_addr = stack_addr;
+  tp->stack_size = stack_size;
+#endif
   tp->next = tp->prev = (struct chx_pq *)tp;
   tp->mutex_list = NULL;
   tp->clp = NULL;
@@ -615,13 +1521,35 @@ chopstx_create (uint32_t flags_and_prio,
   tp->flag_got_cancel = tp->flag_join_req = 0;
   tp->flag_cancelable = 1;
   tp->flag_sched_rr = (flags_and_prio & CHOPSTX_SCHED_RR)? 1 : 0;
+#if defined(CHX_RR_QUANTUM)
+  tp->slice = tp->slice_left = chx_slice_ticks (flags_and_prio);
+#endif
+#if defined(CHX_SCHED_EDF)
+  tp->flag_sched_edf = (flags_and_prio & CHOPSTX_SCHED_EDF)? 1 : 0;
+#else
+  tp->flag_sched_edf = 0;
+#endif
   tp->flag_detached = (flags_and_prio & CHOPSTX_DETACHED)? 1 : 0;
   tp->flag_is_proxy = 0;
   tp->prio_orig = tp->prio = prio;
   tp->parent = NULL;
   tp->v = 0;
+#if defined(CHX_PERIODIC)
+  tp->release = 0;
+  tp->period = tp->missed = 0;
+#endif
+#if defined(CHX_SCHED_EDF)
+  tp->edf_deadline = EDF_NO_DEADLINE;
+  tp->rel_deadline = 0;
+#endif
+#if defined(CHX_CPU_BUDGET)
+  tp->budget = NULL;
+#endif
 
   chx_cpu_sched_lock ();
+#if defined(CHX_THREAD_LIST)
+  chx_thread_link (tp);
+#endif
   chx_ready_enqueue (tp);
   if (tp->prio > running->prio)
     chx_sched (CHX_YIELD);
@@ -632,15 +1560,7 @@ chopstx_create (uint32_t flags_and_prio,
 }
 
 /*
- * Internal timer uses SYSTICK and it has rather smaller upper limit.
- * Thus, we can't let the thread sleep too long, but let it loops.
- *
- * The caller should make a loop with chx_snooze.
- */
-#define MAX_USEC_FOR_TIMER (16777215/MHZ) /* SYSTICK is 24-bit. */
-
-/*
- * Sleep for some event (MAX_USEC_FOR_TIMER at max).
+ * Sleep for some event until DEADLINE (in ticks).
  *
  * Returns:
  *         -1 on cancellation of the thread.
@@ -648,46 +1568,44 @@ chopstx_create (uint32_t flags_and_prio,
  *          1 when no sleep is needed any more, or some event occurs.
  */
 static int
-chx_snooze (uint32_t state, uint32_t *usec_p)
+chx_snooze (uint32_t state, uint64_t deadline)
 {
-  uint32_t usec = *usec_p;
-  uint32_t usec0;
-  int r;
-
-  if (usec == 0)
+  if ((int64_t)(deadline - chx_clock_ticks ()) <= 0)
     {
       chx_cpu_sched_unlock ();
       return 1;
     }
 
-  usec0 = (usec > MAX_USEC_FOR_TIMER) ? MAX_USEC_FOR_TIMER: usec;
-  if (running->flag_sched_rr)
-    chx_timer_dequeue (running);
-
   chx_spin_lock (&q_timer.lock);
   running->state = state;
-  chx_timer_insert (running, usec0);
+  chx_timer_insert_until (running, deadline);
   chx_spin_unlock (&q_timer.lock);
-  r = chx_sched (CHX_SLEEP);
-  if (r == 0)
-    *usec_p -= usec0;
-
-  return r;
+  return chx_sched (CHX_SLEEP);
 }
 
 
-static void
-chopstx_usec_wait_var (uint32_t *var)
+/* Get ticks of the clock, without holding schedule lock.  */
+static uint64_t
+chx_clock_get (void)
 {
-  int r = 0;
+  uint64_t ticks;
 
-  do
-    {
-      chopstx_testcancel ();
-      chx_cpu_sched_lock ();
-      r = chx_snooze (THREAD_WAIT_TIME, var);
-    }
-  while (r == 0);
+  chx_cpu_sched_lock ();
+  ticks = chx_clock_ticks ();
+  chx_cpu_sched_unlock ();
+  return ticks;
+}
+
+
+/**
+ * chopstx_clock_gettime - Get the time of monotonic clock
+ *
+ * Returns micro seconds since the start of the system.
+ */
+uint64_t
+chopstx_clock_gettime (void)
+{
+  return chx_clock_get () / MHZ;
 }
 
 
@@ -700,62 +1618,255 @@ chopstx_usec_wait_var (uint32_t *var)
 void
 chopstx_usec_wait (uint32_t usec)
 {
-  chopstx_usec_wait_var (&usec);
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  chx_snooze (THREAD_WAIT_TIME, chx_clock_ticks () + usec_to_ticks (usec));
 }
 
 
 /**
- * chopstx_mutex_init - Initialize the mutex
- * @mutex: Mutex
+ * chopstx_sleep_until - Sleep until the time
+ * @usec: time in micro seconds, of chopstx_clock_gettime
  *
- * Initialize @mutex.
+ * Sleep until the clock reaches @usec.  Unlike chopstx_usec_wait, a
+ * periodic loop with this doesn't accumulate drift.
  */
 void
-chopstx_mutex_init (chopstx_mutex_t *mutex)
+chopstx_sleep_until (uint64_t usec)
 {
-  chx_spin_init (&mutex->lock);
-  mutex->q.next = mutex->q.prev = (struct chx_pq *)&mutex->q;
-  mutex->list = NULL;
-  mutex->owner = NULL;
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  chx_snooze (THREAD_WAIT_TIME, usec * MHZ);
 }
 
 
+#if defined(CHX_PERIODIC)
+#if defined(CHX_SCHED_EDF)
 /*
- * Re-queue TP after priority change.
- * Returns a thread which can wake up this thread TP.
+ * Update the absolute deadline of TP of CHOPSTX_SCHED_EDF, for the
+ * job released at the last release (TP->RELEASE is the next one).
+ * Called with schedule lock held, when TP is not on READY queue.
  */
-static struct chx_thread *
-requeue (struct chx_thread *tp)
+static void
+chx_edf_release (struct chx_thread *tp)
 {
-  if (tp->state == THREAD_READY)
-    {
-      chx_spin_lock (&q_ready.lock);
-      ll_prio_enqueue (ll_dequeue ((struct chx_pq *)tp), tp->parent);
-      chx_spin_unlock (&q_ready.lock);
-    }
-  else if (tp->state == THREAD_WAIT_MTX)
-    {
-      struct chx_mtx *mutex = (struct chx_mtx *)tp->parent;
-
-      chx_spin_lock (&mutex->lock);
-      ll_prio_enqueue (ll_dequeue ((struct chx_pq *)tp), tp->parent);
-      chx_spin_unlock (&mutex->lock);
-      return mutex->owner;
-    }
-  else if (tp->state == THREAD_WAIT_CND)
-    {
-      struct chx_cond *cond = (struct chx_cond *)tp->parent;
+  uint32_t rel = tp->rel_deadline ? tp->rel_deadline : tp->period;
 
-      chx_spin_lock (&cond->lock);
-      ll_prio_enqueue (ll_dequeue ((struct chx_pq *)tp), tp->parent);
-      chx_spin_unlock (&cond->lock);
-      /* We don't know who can wake up this thread.  */
-    }
-  else if (tp->state == THREAD_WAIT_EXIT)
-    /* Requeue is not needed as waiting for the thread is only by one.  */
-    return (struct chx_thread *)tp->v;
+  if (!tp->flag_sched_edf)
+    return;
 
-  return NULL;
+  if (tp->period == 0)
+    tp->edf_deadline = EDF_NO_DEADLINE;
+  else
+    tp->edf_deadline = tp->release - usec_to_ticks (tp->period)
+      + usec_to_ticks (rel);
+}
+#else
+#define chx_edf_release(tp)
+#endif
+
+
+/**
+ * chopstx_periodic_start - Start periodic release of running thread
+ * @period_usec: Period in micro seconds, or 0 to stop
+ *
+ * Start periodic release of running thread, from now.  The first job
+ * runs now, and its deadline is the next release, @period_usec later.
+ * Call chopstx_periodic_wait at the end of each job.
+ */
+void
+chopstx_periodic_start (uint32_t period_usec)
+{
+  struct chx_thread *tp = running;
+
+  chx_cpu_sched_lock ();
+  tp->period = period_usec;
+  tp->missed = 0;
+  tp->release = chx_clock_ticks () + usec_to_ticks (period_usec);
+  chx_edf_release (tp);
+  chx_cpu_sched_unlock ();
+}
+
+
+#if defined(CHX_SCHED_EDF)
+/**
+ * chopstx_periodic_deadline - Set relative deadline of running thread
+ * @deadline_usec: Deadline in micro seconds from each release, or 0
+ *
+ * Set relative deadline of running thread, for its jobs released by
+ * chopstx_periodic_start and chopstx_periodic_wait.  When it is 0
+ * (default), the deadline is the next release.  It matters for
+ * scheduling of thread of CHOPSTX_SCHED_EDF only; in its priority
+ * band, the thread with earliest absolute deadline runs first.  A
+ * release by the timer preempts running thread of the band with later
+ * deadline.  Other wakeups preempt by priority only.  Call this before
+ * chopstx_periodic_start.
+ */
+void
+chopstx_periodic_deadline (uint32_t deadline_usec)
+{
+  running->rel_deadline = deadline_usec;
+}
+#endif
+
+
+/**
+ * chopstx_periodic_wait - Wait for next periodic release
+ *
+ * Sleep until the next release of running thread.  Releases are at
+ * absolute times by the period from chopstx_periodic_start, so, they
+ * don't drift.  When the job overruns its deadline (the next
+ * release), it returns immediately, skipping releases already passed.
+ * Returns the number of those releases (missed deadlines), or 0 when
+ * the job is on time.  Returns -1 when the running thread has no
+ * period (chopstx_periodic_start is not called, or called with 0).
+ * This is a cancellation point.
+ */
+int
+chopstx_periodic_wait (void)
+{
+  struct chx_thread *tp = running;
+  uint64_t period, release, now;
+  int missed = 0;
+
+  chopstx_testcancel ();
+  if (tp->period == 0)
+    return -1;
+
+  chx_cpu_sched_lock ();
+  period = usec_to_ticks (tp->period);
+  release = tp->release;
+  if ((int64_t)(release - chx_clock_ticks ()) >= 0)
+    {
+      tp->release = release + period;
+      chx_edf_release (tp);
+      if (chx_snooze (THREAD_WAIT_TIME, release) < 0)
+	chopstx_exit (CHOPSTX_CANCELED);
+      return 0;
+    }
+
+  /* Overrun.  Run the next job now, for the next release.  */
+  now = chx_clock_ticks ();
+  do
+    {
+      tp->release += period;
+      missed++;
+    }
+  while ((int64_t)(tp->release - now) <= 0);
+  tp->missed += missed;
+  chx_edf_release (tp);
+  chx_cpu_sched_unlock ();
+  return missed;
+}
+
+
+/**
+ * chopstx_periodic_missed - Get the number of missed deadlines
+ *
+ * Returns the number of missed deadlines of running thread, since
+ * chopstx_periodic_start.
+ */
+uint32_t
+chopstx_periodic_missed (void)
+{
+  return running->missed;
+}
+#endif
+
+
+/**
+ * chopstx_mutex_init - Initialize the mutex
+ * @mutex: Mutex
+ *
+ * Initialize @mutex.
+ */
+void
+chopstx_mutex_init (chopstx_mutex_t *mutex)
+{
+  chx_spin_init (&mutex->lock);
+  mutex->q.next = mutex->q.prev = (struct chx_pq *)&mutex->q;
+  mutex->list = NULL;
+  mutex->owner = NULL;
+#if defined(CHX_MUTEX_PROFILE)
+  chx_mutex_profile_init (mutex);
+#endif
+}
+
+
+/*
+ * Re-queue TP after priority change.
+ * Returns a thread which can wake up this thread TP.
+ */
+static struct chx_thread *
+requeue (struct chx_thread *tp)
+{
+  if (tp->state == THREAD_READY)
+    {
+      chx_spin_lock (&q_ready.lock);
+      if (tp == q_ready_first)
+	q_ready_first = NULL;
+      else
+#if defined(CHX_READY_QUEUE_BITMAP)
+	ready_remove (tp);
+#else
+	ll_dequeue ((struct chx_pq *)tp);
+#endif
+      ready_put (tp);
+      chx_spin_unlock (&q_ready.lock);
+    }
+  else if (tp->state == THREAD_WAIT_MTX)
+    {
+      struct chx_mtx *mutex = (struct chx_mtx *)tp->parent;
+
+      chx_spin_lock (&mutex->lock);
+      ll_prio_enqueue (ll_dequeue ((struct chx_pq *)tp), tp->parent);
+      chx_spin_unlock (&mutex->lock);
+      return MUTEX_OWNER (mutex);
+    }
+  else if (tp->state == THREAD_WAIT_CND)
+    {
+      struct chx_cond *cond = (struct chx_cond *)tp->parent;
+
+      chx_spin_lock (&cond->lock);
+      ll_prio_enqueue (ll_dequeue ((struct chx_pq *)tp), tp->parent);
+      chx_spin_unlock (&cond->lock);
+      /* We don't know who can wake up this thread.  */
+    }
+  else if (tp->state == THREAD_WAIT_EXIT)
+    /* Requeue is not needed as waiting for the thread is only by one.  */
+    return (struct chx_thread *)tp->v;
+
+  return NULL;
+}
+
+/*
+ * Priority inheritance: the owner of mutex M gets the priority of TP,
+ * which is going to wait for M.  So does the owner of the mutex which
+ * the owner waits for, and so on.  Called with schedule lock held.
+ */
+static void
+chx_mutex_inherit (chopstx_mutex_t *m, struct chx_thread *tp)
+{
+  struct chx_thread *tp0 = MUTEX_OWNER (m);
+
+  while (tp0 && tp0->prio < tp->prio)
+    {
+#if defined(CHX_MUTEX_PROFILE)
+      m->boosted++;
+#endif
+      tp0->prio = tp->prio;
+      if (tp0->state == THREAD_WAIT_TIME
+	  || tp0->state == THREAD_WAIT_POLL)
+	{
+	  if (tp0->parent == &q_timer.q)
+	    chx_timer_dequeue (tp0);
+	  tp0->v = (uintptr_t)1;
+	  chx_ready_enqueue (tp0);
+	  tp0 = NULL;
+	}
+      else
+	tp0 = requeue (tp0);
+    }
 }
 
 /**
@@ -768,46 +1879,72 @@ void
 chopstx_mutex_lock (chopstx_mutex_t *mutex)
 {
   struct chx_thread *tp = running;
+#if defined(CHX_MUTEX_PROFILE)
+  int waited = 0;
+  uint64_t wait_start = 0;
+#endif
+
+#if defined(CHX_MUTEX_FAST_PATH)
+  {
+    struct chx_thread *owner = NULL;
+
+    if (__atomic_compare_exchange_n (&mutex->owner, &owner, tp, 0,
+				     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+	/* The mutex is acquired.  */
+	mutex->list = tp->mutex_list;
+	tp->mutex_list = mutex;
+#if defined(CHX_MUTEX_PROFILE)
+	mutex->acquired++;
+#endif
+	return;
+      }
+  }
+#endif
 
   while (1)
     {
       chopstx_mutex_t *m = mutex;
-      struct chx_thread *tp0;
 
       chx_cpu_sched_lock ();
       chx_spin_lock (&m->lock);
-      if (m->owner == NULL)
+      if (MUTEX_OWNER (m) == NULL)
 	{
 	  /* The mutex is acquired.  */
+#if defined(CHX_MUTEX_FAST_PATH)
+	  if (!ll_empty (&m->q))
+	    tp = (struct chx_thread *)((uintptr_t)tp | MUTEX_WAITER);
+	  m->owner = tp;
+	  tp = running;
+#else
 	  m->owner = tp;
+#endif
 	  m->list = tp->mutex_list;
 	  tp->mutex_list = m;
+#if defined(CHX_MUTEX_PROFILE)
+	  chx_mutex_profile_acquired (m, waited, wait_start);
+#endif
+	  chx_trace (CHOPSTX_TRACE_MUTEX_LOCK, tp, 0, m);
 	  chx_spin_unlock (&m->lock);
 	  chx_cpu_sched_unlock ();
 	  break;
 	}
 
-      /* Priority inheritance.  */
-      tp0 = m->owner;
-      while (tp0 && tp0->prio < tp->prio)
-	{
-	  tp0->prio = tp->prio;
-	  if (tp0->state == THREAD_WAIT_TIME
-	      || tp0->state == THREAD_WAIT_POLL)
-	    {
-	      tp0->v = (uintptr_t)1;
-	      if (tp0->parent == &q_timer.q)
-		chx_timer_dequeue (tp0);
+#if defined(CHX_MUTEX_FAST_PATH)
+      /* Let the owner unlock by the slow path.  */
+      m->owner = (struct chx_thread *)((uintptr_t)m->owner | MUTEX_WAITER);
+#endif
 
-	      chx_ready_enqueue (tp0);
-	      tp0 = NULL;
-	    }
-	  else
-	    tp0 = requeue (tp0);
-	}
+      chx_mutex_inherit (m, tp);
 
-      if (tp->flag_sched_rr)
-	chx_timer_dequeue (tp);
+#if defined(CHX_MUTEX_PROFILE)
+      if (!waited)
+	{
+	  waited = 1;
+	  wait_start = chx_clock_ticks ();
+	}
+#endif
+      chx_trace (CHOPSTX_TRACE_MUTEX_WAIT, tp, 0, mutex);
       ll_prio_enqueue ((struct chx_pq *)tp, &mutex->q);
       tp->state = THREAD_WAIT_MTX;
       chx_spin_unlock (&mutex->lock);
@@ -827,6 +1964,18 @@ chopstx_mutex_unlock (chopstx_mutex_t *mutex)
 {
   chopstx_prio_t prio;
 
+#if defined(CHX_MUTEX_FAST_PATH)
+  {
+    struct chx_thread *owner = running;
+
+    /* Update the list before release, as others may lock it then.  */
+    running->mutex_list = mutex->list;
+    if (__atomic_compare_exchange_n (&mutex->owner, &owner, NULL, 0,
+				     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+  }
+#endif
+
   chx_cpu_sched_lock ();
   chx_spin_lock (&mutex->lock);
   prio = chx_mutex_unlock (mutex);
@@ -838,6 +1987,224 @@ chopstx_mutex_unlock (chopstx_mutex_t *mutex)
 }
 
 
+/*
+ * Reader-writer lock.
+ *
+ * It is a mutex with the number of shared owners.  An exclusive owner
+ * is the owner of the mutex, so, it is on the mutex_list of the
+ * thread, gets priority inheritance, and is released by chopstx_exit.
+ * Shared owners are not tracked, they don't get priority inheritance.
+ *
+ * Both of readers and writers wait on the queue of the mutex (->V of a
+ * waiting reader is RWLOCK_SHARED), and try again when woken up.  A
+ * reader which gets the lock wakes up other readers.
+ */
+#define RWLOCK_SHARED ((uintptr_t)1)
+
+static int
+chx_rwlock_blocks_reader (chopstx_rwlock_t *rw)
+{
+  return (MUTEX_OWNER (&rw->mtx)
+	  || ((rw->flags & CHOPSTX_RWLOCK_PREFER_WRITER) && rw->writers));
+}
+
+/*
+ * Wake up waiting readers when they can get the lock.  Called with
+ * schedule lock held.  Returns the highest priority of woken threads.
+ */
+static chopstx_prio_t
+chx_rwlock_wakeup_readers (chopstx_rwlock_t *rw)
+{
+  struct chx_pq *p, *p_next;
+  chopstx_prio_t prio = 0;
+
+  if (chx_rwlock_blocks_reader (rw))
+    return 0;
+
+  for (p = rw->mtx.q.next; p != (struct chx_pq *)&rw->mtx.q; p = p_next)
+    {
+      struct chx_thread *tp = (struct chx_thread *)p;
+
+      p_next = p->next;
+      if (tp->v == RWLOCK_SHARED)
+	{
+	  chx_ready_enqueue ((struct chx_thread *)ll_dequeue (p));
+	  if (prio < tp->prio)
+	    prio = tp->prio;
+	}
+    }
+
+  return prio;
+}
+
+/*
+ * Wake up the first waiting writer.  Called with schedule lock held.
+ */
+static void
+chx_rwlock_wakeup_writer (chopstx_rwlock_t *rw)
+{
+  struct chx_pq *p;
+
+  for (p = rw->mtx.q.next; p != (struct chx_pq *)&rw->mtx.q; p = p->next)
+    if (((struct chx_thread *)p)->v != RWLOCK_SHARED)
+      {
+	chx_ready_enqueue ((struct chx_thread *)ll_dequeue (p));
+	break;
+      }
+}
+
+/*
+ * Sleep on the queue of RW.  Called with schedule lock and RW's lock
+ * held, and returns with them held again.
+ */
+static void
+chx_rwlock_sleep (chopstx_rwlock_t *rw, struct chx_thread *tp,
+		  uintptr_t shared)
+{
+  chx_trace (CHOPSTX_TRACE_MUTEX_WAIT, tp, shared, rw);
+  ll_prio_enqueue ((struct chx_pq *)tp, &rw->mtx.q);
+  tp->state = THREAD_WAIT_MTX;
+  tp->v = shared;
+  chx_spin_unlock (&rw->mtx.lock);
+  chx_sched (CHX_SLEEP);
+  chx_cpu_sched_lock ();
+  chx_spin_lock (&rw->mtx.lock);
+}
+
+/**
+ * chopstx_rwlock_init - Initialize the reader-writer lock
+ * @rw: Reader-writer lock
+ * @flags: CHOPSTX_RWLOCK_PREFER_WRITER or 0
+ *
+ * Initialize @rw.  By default, a reader gets the lock when it's not
+ * held exclusively, even if writers are waiting.  With
+ * CHOPSTX_RWLOCK_PREFER_WRITER, a reader waits while a writer waits.
+ */
+void
+chopstx_rwlock_init (chopstx_rwlock_t *rw, int flags)
+{
+  chopstx_mutex_init (&rw->mtx);
+  rw->readers = 0;
+  rw->writers = 0;
+  rw->flags = flags;
+}
+
+/**
+ * chopstx_rwlock_rdlock - Lock the reader-writer lock for reading
+ * @rw: Reader-writer lock
+ *
+ * Lock @rw, shared with other readers.
+ *
+ * Readers are not tracked.  A reader doesn't get priority
+ * inheritance, so, a writer of higher priority may wait for a reader
+ * of lower priority which is preempted by a thread of middle
+ * priority; keep the read section short, or run readers at the
+ * priority of writers.  A shared lock is not released by
+ * chopstx_exit; when a reader may be canceled, unlock @rw by its
+ * cleanup handler (chopstx_cleanup_push).
+ */
+void
+chopstx_rwlock_rdlock (chopstx_rwlock_t *rw)
+{
+  struct chx_thread *tp = running;
+  chopstx_prio_t prio = 0;
+
+  chx_cpu_sched_lock ();
+  chx_spin_lock (&rw->mtx.lock);
+  while (chx_rwlock_blocks_reader (rw))
+    {
+      if (MUTEX_OWNER (&rw->mtx))
+	chx_mutex_inherit (&rw->mtx, tp);
+      else if (rw->readers == 0)
+	/* Free, but a writer has preference.  Let it go.  */
+	chx_rwlock_wakeup_writer (rw);
+      chx_rwlock_sleep (rw, tp, RWLOCK_SHARED);
+    }
+
+  rw->readers++;
+  chx_trace (CHOPSTX_TRACE_MUTEX_LOCK, tp, 1, rw);
+  if (!ll_empty (&rw->mtx.q))
+    prio = chx_rwlock_wakeup_readers (rw);
+  chx_spin_unlock (&rw->mtx.lock);
+  if (prio > tp->prio)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+}
+
+/**
+ * chopstx_rwlock_wrlock - Lock the reader-writer lock for writing
+ * @rw: Reader-writer lock
+ *
+ * Lock @rw exclusively.  Like a mutex, it should be unlocked in the
+ * reverse order of locking, with other mutexes.
+ */
+void
+chopstx_rwlock_wrlock (chopstx_rwlock_t *rw)
+{
+  struct chx_thread *tp = running;
+  chopstx_mutex_t *m = &rw->mtx;
+
+  chx_cpu_sched_lock ();
+  chx_spin_lock (&m->lock);
+  while (MUTEX_OWNER (m) || rw->readers)
+    {
+      chx_mutex_inherit (m, tp);
+      rw->writers++;
+      chx_rwlock_sleep (rw, tp, 0);
+      rw->writers--;
+    }
+
+  m->owner = tp;
+  m->list = tp->mutex_list;
+  tp->mutex_list = m;
+  chx_trace (CHOPSTX_TRACE_MUTEX_LOCK, tp, 0, rw);
+  chx_spin_unlock (&m->lock);
+  chx_cpu_sched_unlock ();
+}
+
+/**
+ * chopstx_rwlock_unlock - Unlock the reader-writer lock
+ * @rw: Reader-writer lock
+ *
+ * Unlock @rw, locked by either of chopstx_rwlock_rdlock or
+ * chopstx_rwlock_wrlock.
+ */
+void
+chopstx_rwlock_unlock (chopstx_rwlock_t *rw)
+{
+  chopstx_mutex_t *m = &rw->mtx;
+  chopstx_prio_t prio = 0;
+
+  chx_cpu_sched_lock ();
+  chx_spin_lock (&m->lock);
+  if (MUTEX_OWNER (m) == running)
+    {
+      chopstx_prio_t prio_r;
+
+      prio = chx_mutex_unlock (m);
+      prio_r = chx_rwlock_wakeup_readers (rw);
+      if (prio < prio_r)
+	prio = prio_r;
+    }
+  else if (--rw->readers == 0)
+    {
+      struct chx_thread *tp = (struct chx_thread *)ll_pop (&m->q);
+
+      if (tp)
+	{
+	  chx_ready_enqueue (tp);
+	  prio = tp->prio;
+	}
+    }
+  chx_spin_unlock (&m->lock);
+  if (prio > running->prio)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+}
+
+
 /**
  * chopstx_cond_init - Initialize the condition variable
  * @cond: Condition variable
@@ -875,11 +2242,11 @@ chopstx_cond_wait (chopstx_cond_t *cond, chopstx_mutex_t *mutex)
       chx_spin_unlock (&mutex->lock);
     }
 
-  if (tp->flag_sched_rr)
-    chx_timer_dequeue (tp);
+  chx_trace (CHOPSTX_TRACE_COND_WAIT, tp, 0, cond);
   chx_spin_lock (&cond->lock);
   ll_prio_enqueue ((struct chx_pq *)tp, &cond->q);
   tp->state = THREAD_WAIT_CND;
+  tp->v = (uintptr_t)mutex;	/* For wait morphing.  */
   chx_spin_unlock (&cond->lock);
   r = chx_sched (CHX_SLEEP);
 
@@ -891,23 +2258,65 @@ chopstx_cond_wait (chopstx_cond_t *cond, chopstx_mutex_t *mutex)
 }
 
 
-/**
- * chopstx_cond_signal - Wake up a thread waiting on the condition variable
- * @cond: Condition variable
+/*
+ * Wakeup the thread (or proxy) PQ waiting on condition variable.
+ * Called with schedule lock held.
  *
- * Wake up a thread waiting on @cond.
+ * When the associated mutex is held by running thread, the thread
+ * will only go to sleep again for the mutex if woken up.  Instead,
+ * move it to the wait queue of the mutex directly (wait morphing).
+ * It is woken up when running thread unlocks the mutex.
  */
-void
-chopstx_cond_signal (chopstx_cond_t *cond)
+static int
+chx_cond_wakeup (struct chx_pq *pq)
+{
+  struct chx_thread *tp = (struct chx_thread *)pq;
+  chopstx_mutex_t *mutex;
+
+  if (pq->flag_is_proxy
+      || (mutex = (chopstx_mutex_t *)tp->v) == NULL
+      || MUTEX_OWNER (mutex) != running)
+    return chx_wakeup (pq);
+
+  chx_spin_lock (&mutex->lock);
+#if defined(CHX_MUTEX_FAST_PATH)
+  /* Let the owner unlock by the slow path.  */
+  mutex->owner = (struct chx_thread *)((uintptr_t)running | MUTEX_WAITER);
+#endif
+  /* Priority inheritance.  */
+  if (running->prio < tp->prio)
+    {
+#if defined(CHX_MUTEX_PROFILE)
+      mutex->boosted++;
+#endif
+      running->prio = tp->prio;
+    }
+  ll_prio_enqueue (pq, &mutex->q);
+  tp->state = THREAD_WAIT_MTX;
+  tp->v = (uintptr_t)1;
+  chx_spin_unlock (&mutex->lock);
+  return 0;
+}
+
+
+/**
+ * chopstx_cond_signal - Wake up a thread waiting on the condition variable
+ * @cond: Condition variable
+ *
+ * Wake up a thread waiting on @cond.
+ */
+void
+chopstx_cond_signal (chopstx_cond_t *cond)
 {
   struct chx_pq *p;
   int yield = 0;
 
   chx_cpu_sched_lock ();
+  chx_trace (CHOPSTX_TRACE_COND_SIGNAL, running, 0, cond);
   chx_spin_lock (&cond->lock);
   p = ll_pop (&cond->q);
   if (p)
-    yield = chx_wakeup (p);
+    yield = chx_cond_wakeup (p);
   chx_spin_unlock (&cond->lock);
   if (yield)
     chx_sched (CHX_YIELD);
@@ -929,9 +2338,10 @@ chopstx_cond_broadcast (chopstx_cond_t *cond)
   int yield = 0;
 
   chx_cpu_sched_lock ();
+  chx_trace (CHOPSTX_TRACE_COND_SIGNAL, running, 1, cond);
   chx_spin_lock (&cond->lock);
   while ((p = ll_pop (&cond->q)))
-    yield |= chx_wakeup (p);
+    yield |= chx_cond_wakeup (p);
   chx_spin_unlock (&cond->lock);
   if (yield)
     chx_sched (CHX_YIELD);
@@ -952,10 +2362,11 @@ chx_cond_hook (struct chx_px *px, struct chx_poll_head *pd)
 
   if ((*pc->check) (pc->arg) != 0)
     {
+      chx_cpu_sched_lock ();
       chx_spin_lock (&px->lock);
-      (*px->counter_p)++;
-      *px->ready_p = 1;
+      chx_proxy_ready (px);
       chx_spin_unlock (&px->lock);
+      chx_cpu_sched_unlock ();
     }
   else
     { /* Condition doesn't met.
@@ -1026,231 +2437,236 @@ chopstx_intr_wait (chopstx_intr_t *intr)
 }
 
 
-/**
- * chopstx_cleanup_push - Register a clean-up
- * @clp: Pointer to clean-up structure
- *
- * Register a clean-up structure.
+/*
+ * Copy a message of SIZE bytes.  Word-wise when possible.
  */
-void
-chopstx_cleanup_push (struct chx_cleanup *clp)
+static void
+chx_mqueue_copy (void *dst, const void *src, uint16_t size)
 {
-  clp->next = running->clp;
-  running->clp = clp;
+  if (((uintptr_t)dst & 3) == 0 && ((uintptr_t)src & 3) == 0
+      && (size & 3) == 0)
+    {
+      uint32_t *d = dst;
+      const uint32_t *s = src;
+
+      for (size /= 4; size; size--)
+	*d++ = *s++;
+    }
+  else
+    {
+      uint8_t *d = dst;
+      const uint8_t *s = src;
+
+      for (; size; size--)
+	*d++ = *s++;
+    }
 }
 
-/**
- * chopstx_cleanup_pop - Release a clean-up
- * @execute: Execute the clen-up function on release
- *
- * Unregister a clean-up structure.  When @execute is non-zero, the
- * clean-up will be executed.
+static uint32_t *
+chx_mqueue_slot (chopstx_mqueue_t *mq, uint16_t i)
+{
+  if (i >= mq->capacity)
+    i -= mq->capacity;
+  return mq->buf + i * mq->words;
+}
+
+/*
+ * Wake up waiters on Q (of message queue or semaphore), in order of
+ * priority.  All proxies (of chopstx_poll) are woken up until a
+ * waiter with a message buffer is found: a thread, or a proxy of
+ * timed wait.  Returns the waiter (not yet woken up), or NULL.
+ * Called with schedule lock held.
  */
-void
-chopstx_cleanup_pop (int execute)
+static struct chx_pq *
+chx_wakeup_proxies (struct chx_cond *q, uint16_t *prio_p, int *yield_p)
 {
-  struct chx_cleanup *clp = running->clp;
+  struct chx_pq *p;
 
-  if (clp)
+  chx_spin_lock (&q->lock);
+  while ((p = ll_pop (&q->q)))
     {
-      running->clp = clp->next;
-      if (execute)
-	clp->routine (clp->arg);
+      if (*prio_p < p->prio)
+	*prio_p = p->prio;
+      if (!p->flag_is_proxy || p->v)
+	break;
+      *yield_p |= chx_wakeup (p);
     }
+  chx_spin_unlock (&q->lock);
+  return p;
 }
 
-
-/**
- * chopstx_exit - Terminate the execution of running thread
- * @retval: Return value (to be caught by a joining thread)
- *
- * Calling this function terminates the execution of running thread,
- * after calling clean up functions.  If the calling thread still
- * holds mutexes, they will be released.  This function never
- * returns.
+/*
+ * Put the message MSG into MQ.  When a thread is waiting for a
+ * message, it is handed off to the thread directly.  Returns -1 when
+ * MQ is full, 1 when rescheduling is needed, or 0.  *PRIO_P is
+ * updated with the priority of a thread woken up.  Called with
+ * schedule lock held (or, from interrupt handler).
  */
-void
-chopstx_exit (void *retval)
+static int
+chx_mqueue_put (chopstx_mqueue_t *mq, const void *msg, uint16_t *prio_p)
 {
-  struct chx_mtx *m, *m_next;
-  struct chx_cleanup *clp = running->clp;
+  struct chx_pq *p;
+  int yield = 0;
 
-  running->clp = NULL;
-  while (clp)
+  if (mq->count == mq->capacity)
+    return -1;
+
+  p = chx_wakeup_proxies (&mq->recv, prio_p, &yield);
+  if (p)
     {
-      clp->routine (clp->arg);
-      clp = clp->next;
+      /* The buffer is empty, as the thread waits.  */
+      chx_mqueue_copy ((void *)p->v, msg, mq->size);
+      yield |= chx_wakeup (p);
     }
-
-  /* Release all mutexes this thread still holds.  */
-  for (m = running->mutex_list; m; m = m_next)
+  else
     {
-      m_next = m->list;
-
-      chx_cpu_sched_lock ();
-      chx_spin_lock (&m->lock);
-      chx_mutex_unlock (m);
-      chx_spin_unlock (&m->lock);
-      chx_cpu_sched_unlock ();
+      chx_mqueue_copy (chx_mqueue_slot (mq, mq->head + mq->count), msg,
+		       mq->size);
+      mq->count++;
     }
 
-  chx_exit (retval);
+  return yield;
 }
 
-
-/**
- * chopstx_join - join with a terminated thread
- * @thd: Thread to wait
- * @ret: Pointer to void * to store return value
- *
- * Waits for the thread of @thd to terminate.
- * Returns 0 on success, 1 when waiting is interrupted.
+/*
+ * Get a message from MQ into MSG.  When a thread is waiting for a
+ * room, its message is put into the room.  Returns -1 when MQ is
+ * empty, 1 when rescheduling is needed, or 0.  Called with schedule
+ * lock held.
  */
-int
-chopstx_join (chopstx_t thd, void **ret)
+static int
+chx_mqueue_get (chopstx_mqueue_t *mq, void *msg)
 {
-  struct chx_thread *tp = (struct chx_thread *)thd;
-  int r = 0;
+  struct chx_pq *p;
+  uint16_t prio = 0;
+  int yield = 0;
 
-  /*
-   * We don't offer deadlock detection.  It's users' responsibility.
-   */
+  if (mq->count == 0)
+    return -1;
 
-  chopstx_testcancel ();
+  chx_mqueue_copy (msg, chx_mqueue_slot (mq, mq->head), mq->size);
+  if (++mq->head == mq->capacity)
+    mq->head = 0;
+  mq->count--;
 
-  chx_cpu_sched_lock ();
-  if (tp->flag_detached)
+  p = chx_wakeup_proxies (&mq->send, &prio, &yield);
+  if (p)
     {
-      chx_cpu_sched_unlock ();
-      chx_fatal (CHOPSTX_ERR_JOIN);
+      chx_mqueue_copy (chx_mqueue_slot (mq, mq->head + mq->count),
+		       (const void *)p->v, mq->size);
+      mq->count++;
+      yield |= chx_wakeup (p);
     }
 
-  if (tp->state != THREAD_EXITED)
-    {
-      struct chx_thread *tp0 = tp;
+  return yield;
+}
 
-      if (running->flag_sched_rr)
-	chx_timer_dequeue (running);
-      chx_spin_lock (&q_join.lock);
-      ll_prio_enqueue ((struct chx_pq *)running, &q_join.q);
-      running->v = (uintptr_t)tp;
-      running->state = THREAD_WAIT_EXIT;
-      tp->flag_join_req = 1;
+/*
+ * Let running thread wait on Q, with the buffer BUF for its message.
+ * Called with schedule lock held.  Returns after woken up.
+ */
+static void
+chx_mqueue_wait (struct chx_cond *q, const void *buf)
+{
+  struct chx_thread *tp = running;
+  int r;
 
-      /* Priority inheritance.  */
-      tp0 = tp;
-      while (tp0 && tp0->prio < running->prio)
-	{
-	  tp0->prio = running->prio;
-	  tp0 = requeue (tp0);
-	}
-      chx_spin_unlock (&q_join.lock);
-      r = chx_sched (CHX_SLEEP);
-    }
-  else
-    chx_cpu_sched_unlock ();
+  chx_spin_lock (&q->lock);
+  ll_prio_enqueue ((struct chx_pq *)tp, &q->q);
+  /* Same as condition variable, so that it can be canceled.  */
+  tp->state = THREAD_WAIT_CND;
+  tp->v = (uintptr_t)buf;
+  chx_spin_unlock (&q->lock);
+  r = chx_sched (CHX_SLEEP);
 
   if (r < 0)
     chopstx_exit (CHOPSTX_CANCELED);
-
-  if (r == 0)
-    {
-      tp->state = THREAD_FINISHED;
-      if (ret)
-	*ret = (void *)tp->v;
-    }
-
-  return r;
 }
 
-
-static void
-chx_join_hook (struct chx_px *px, struct chx_poll_head *pd)
+/*
+ * Let running thread wait on Q, with the buffer BUF for its message,
+ * until DEADLINE.  A proxy with BUF waits on Q, while the thread
+ * sleeps on the timer queue.  Called with schedule lock held.
+ * Returns 1 when the message is handed off, 0 on timeout.
+ */
+static int
+chx_mqueue_timedwait (struct chx_cond *q, const void *buf, uint64_t deadline)
 {
-  struct chx_poll_join *pj = (struct chx_poll_join *)pd;
-  struct chx_thread *tp = (struct chx_thread *)pj->thd;
-
-  chopstx_testcancel ();
-  chx_cpu_sched_lock ();
+  uint32_t counter = 0;
+  uint16_t ready = 0;
+  struct chx_px px;
+  int r;
 
-  if (tp->flag_detached)
-    {
-      chx_cpu_sched_unlock ();
-      chx_fatal (CHOPSTX_ERR_JOIN);
-    }
+  chx_proxy_init (&px, &counter);
+  px.v = (uintptr_t)buf;
+  px.ready_p = &ready;
+  chx_spin_lock (&q->lock);
+  ll_prio_enqueue ((struct chx_pq *)&px, &q->q);
+  chx_spin_unlock (&q->lock);
+  r = chx_snooze (THREAD_WAIT_POLL, deadline);
 
-  if (tp->state == THREAD_EXITED)
+  chx_cpu_sched_lock ();
+  chx_spin_lock (&px.lock);
+  if (counter == 0)
     {
-      chx_spin_lock (&px->lock);
-      (*px->counter_p)++;
-      *px->ready_p = 1;
-      chx_spin_unlock (&px->lock);
-    }
-  else
-    { /* Not yet exited.
-       * Register the proxy to wait for TP's exit.
-       */
-      px->v = (uintptr_t)tp;
-      chx_spin_lock (&q_join.lock);
-      ll_prio_enqueue ((struct chx_pq *)px, &q_join.q);
-      chx_spin_unlock (&q_join.lock);
-      tp->flag_join_req = 1;
+      chx_spin_lock (&q->lock);
+      ll_dequeue ((struct chx_pq *)&px);
+      chx_spin_unlock (&q->lock);
     }
+  chx_spin_unlock (&px.lock);
   chx_cpu_sched_unlock ();
+
+  if (r < 0)
+    chopstx_exit (CHOPSTX_CANCELED);
+
+  return counter != 0;
 }
 
 
 /**
- * chopstx_cancel - request a cancellation to a thread
- * @thd: Thread to be canceled
+ * chopstx_mqueue_init - Initialize the message queue
+ * @mq: Message queue
+ * @buf: Ring buffer of CHOPSTX_MQUEUE_BUF_WORDS (@size, @n) words
+ * @size: Size of a message in bytes
+ * @n: Number of messages which can be queued
  *
- * This function requests a cancellation of a thread @thd.
- * No return value.
+ * Initialize @mq.  Messages are copied word by word, when @size is a
+ * multiple of four and messages are aligned.
  */
 void
-chopstx_cancel (chopstx_t thd)
+chopstx_mqueue_init (chopstx_mqueue_t *mq, uint32_t *buf,
+		     uint16_t size, uint16_t n)
 {
-  struct chx_thread *tp = (struct chx_thread *)thd;
-
-  chx_cpu_sched_lock ();
-  tp->flag_got_cancel = 1;
-  if (!tp->flag_cancelable)
-    {
-      chx_cpu_sched_unlock ();
-      return;
-    }
+  chopstx_cond_init (&mq->recv);
+  chopstx_cond_init (&mq->send);
+  mq->buf = buf;
+  mq->size = size;
+  mq->words = (size + 3) / 4;
+  mq->capacity = n;
+  mq->count = 0;
+  mq->head = 0;
+}
 
-  /* Cancellation points: cond_wait, usec_wait, join, and poll.  */
-  if (tp->state == THREAD_WAIT_CND)
-    {
-      struct chx_cond *cond = (struct chx_cond *)tp->parent;
 
-      chx_spin_lock (&cond->lock);
-      ll_dequeue ((struct chx_pq *)tp);
-      chx_spin_unlock (&cond->lock);
-    }
-  else if (tp->state == THREAD_WAIT_TIME)
-    chx_timer_dequeue (tp);
-  else if (tp->state == THREAD_WAIT_EXIT)
-    {
-      chx_spin_lock (&q_join.lock);
-      ll_dequeue ((struct chx_pq *)tp);
-      chx_spin_unlock (&q_join.lock);
-    }
-  else if (tp->state == THREAD_WAIT_POLL)
-    {
-      if (tp->parent == &q_timer.q)
-	chx_timer_dequeue (tp);
-    }
-  else
-    {
-      chx_cpu_sched_unlock ();
-      return;
-    }
+/**
+ * chopstx_mqueue_send - Send a message to the message queue
+ * @mq: Message queue
+ * @msg: Message
+ *
+ * Send @msg to @mq.  Wait while @mq is full.
+ */
+void
+chopstx_mqueue_send (chopstx_mqueue_t *mq, const void *msg)
+{
+  uint16_t prio = 0;
+  int r;
 
-  tp->v = (uintptr_t)-1;
-  chx_ready_enqueue (tp);
-  if (tp->prio > running->prio)
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  r = chx_mqueue_put (mq, msg, &prio);
+  if (r < 0)
+    chx_mqueue_wait (&mq->send, msg);
+  else if (r)
     chx_sched (CHX_YIELD);
   else
     chx_cpu_sched_unlock ();
@@ -1258,174 +2674,2129 @@ chopstx_cancel (chopstx_t thd)
 
 
 /**
- * chopstx_testcancel - catch pending cancellation request
+ * chopstx_mqueue_receive - Receive a message from the message queue
+ * @mq: Message queue
+ * @msg: Buffer for the message
  *
- * Calling chopstx_testcancel creates a cancellation point.
- * No return value.  If the thread is canceled, this function
- * does not return.
+ * Receive a message from @mq into @msg.  Wait while @mq is empty.
  */
 void
-chopstx_testcancel (void)
+chopstx_mqueue_receive (chopstx_mqueue_t *mq, void *msg)
 {
-  if (running->flag_cancelable && running->flag_got_cancel)
-    chopstx_exit (CHOPSTX_CANCELED);
-}
+  int r;
+
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  r = chx_mqueue_get (mq, msg);
+  if (r < 0)
+    chx_mqueue_wait (&mq->recv, msg);
+  else if (r)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+}
+
+
+/**
+ * chopstx_mqueue_try_send - Send a message, if possible
+ * @mq: Message queue
+ * @msg: Message
+ *
+ * Send @msg to @mq, without waiting.  Returns 1 on success, 0 when @mq
+ * is full.
+ */
+int
+chopstx_mqueue_try_send (chopstx_mqueue_t *mq, const void *msg)
+{
+  uint16_t prio = 0;
+  int r;
+
+  chx_cpu_sched_lock ();
+  r = chx_mqueue_put (mq, msg, &prio);
+  if (r > 0)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+  return r >= 0;
+}
+
+
+/**
+ * chopstx_mqueue_try_receive - Receive a message, if any
+ * @mq: Message queue
+ * @msg: Buffer for the message
+ *
+ * Receive a message from @mq into @msg, without waiting.  Returns 1 on
+ * success, 0 when @mq is empty.
+ */
+int
+chopstx_mqueue_try_receive (chopstx_mqueue_t *mq, void *msg)
+{
+  int r;
+
+  chx_cpu_sched_lock ();
+  r = chx_mqueue_get (mq, msg);
+  if (r > 0)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+  return r >= 0;
+}
+
+
+/**
+ * chopstx_mqueue_send_from_isr - Send a message from interrupt handler
+ * @mq: Message queue
+ * @msg: Message
+ *
+ * Send @msg to @mq, without waiting.  Returns 1 on success, 0 when @mq
+ * is full.
+ *
+ * On Cortex-M, this can be called from an interrupt handler whose
+ * priority is same as interrupts which Chopstx handles, that is, one
+ * which is masked by the schedule lock.  Switch to the woken thread is
+ * done after return from the handler.  On GNU/Linux emulation, this
+ * is same as chopstx_mqueue_try_send, except in a callback of
+ * software timer without work queue.
+ */
+int
+chopstx_mqueue_send_from_isr (chopstx_mqueue_t *mq, const void *msg)
+{
+  uint16_t prio = 0;
+  int r;
+
+#ifdef GNU_LINUX_EMULATION
+  if (!swtimer_in_callback)
+    return chopstx_mqueue_try_send (mq, msg);
+#endif
+  r = chx_mqueue_put (mq, msg, &prio);
+  if (r > 0)
+    chx_request_preemption_from_isr (prio);
+  return r >= 0;
+}
+
+
+/**
+ * chopstx_mqueue_send_timeout - Send a message with timeout
+ * @mq: Message queue
+ * @msg: Message
+ * @usec: Timeout in micro seconds
+ *
+ * Send @msg to @mq.  Wait while @mq is full, up to @usec.  Returns 1
+ * on success, 0 on timeout.
+ */
+int
+chopstx_mqueue_send_timeout (chopstx_mqueue_t *mq, const void *msg,
+			     uint32_t usec)
+{
+  uint16_t prio = 0;
+  int r;
+
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  r = chx_mqueue_put (mq, msg, &prio);
+  if (r < 0)
+    {
+      if (usec == 0)
+	{
+	  chx_cpu_sched_unlock ();
+	  return 0;
+	}
+      return chx_mqueue_timedwait (&mq->send, msg,
+				   chx_clock_ticks () + usec_to_ticks (usec));
+    }
+  else if (r)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+  return 1;
+}
+
+
+/**
+ * chopstx_mqueue_receive_timeout - Receive a message with timeout
+ * @mq: Message queue
+ * @msg: Buffer for the message
+ * @usec: Timeout in micro seconds
+ *
+ * Receive a message from @mq into @msg.  Wait while @mq is empty, up
+ * to @usec.  Returns 1 on success, 0 on timeout.
+ */
+int
+chopstx_mqueue_receive_timeout (chopstx_mqueue_t *mq, void *msg,
+				uint32_t usec)
+{
+  int r;
+
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  r = chx_mqueue_get (mq, msg);
+  if (r < 0)
+    {
+      if (usec == 0)
+	{
+	  chx_cpu_sched_unlock ();
+	  return 0;
+	}
+      return chx_mqueue_timedwait (&mq->recv, msg,
+				   chx_clock_ticks () + usec_to_ticks (usec));
+    }
+  else if (r)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+  return 1;
+}
+
+
+/**
+ * chopstx_mqueue_prepare_poll - Prepare a poll descriptor
+ * @mq: Message queue
+ * @p: Poll descriptor
+ * @send: 1 to wait for a room, 0 to wait for a message
+ *
+ * Prepare @p for chopstx_poll.  It becomes ready when @mq has a
+ * message (or a room, when @send is 1).  Note that another thread may
+ * take it before, so, use chopstx_mqueue_try_receive (or
+ * chopstx_mqueue_try_send) when ready.
+ */
+void
+chopstx_mqueue_prepare_poll (chopstx_mqueue_t *mq, chopstx_poll_mqueue_t *p,
+			     int send)
+{
+  p->type = CHOPSTX_POLL_MQUEUE;
+  p->ready = 0;
+  p->mq = mq;
+  p->send = send;
+}
+
+
+static void
+chx_mqueue_hook (struct chx_px *px, struct chx_poll_head *pd)
+{
+  struct chx_poll_mqueue *pm = (struct chx_poll_mqueue *)pd;
+  chopstx_mqueue_t *mq = pm->mq;
+  struct chx_cond *q;
+
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  if (pm->send ? mq->count < mq->capacity : mq->count > 0)
+    {
+      chx_spin_lock (&px->lock);
+      chx_proxy_ready (px);
+      chx_spin_unlock (&px->lock);
+    }
+  else
+    {
+      q = pm->send ? &mq->send : &mq->recv;
+      chx_spin_lock (&q->lock);
+      ll_prio_enqueue ((struct chx_pq *)px, &q->q);
+      chx_spin_unlock (&q->lock);
+    }
+  chx_cpu_sched_unlock ();
+}
+
+
+/*
+ * Semaphore: VALUE holds the count shifted by one, and the bit
+ * SEM_WAITER is set when some thread (or proxy) may wait.
+ */
+#define SEM_WAITER 1
+#define SEM_ONE    2
+
+/*
+ * Take a count of SEM.  Returns 1 on success.  Otherwise, returns 0,
+ * with SEM_WAITER bit set when WAIT is 1.  Without fast path, it
+ * should be called with schedule lock held.
+ */
+static int
+chx_sem_take (chopstx_sem_t *sem, int wait)
+{
+#if defined(CHX_SEM_FAST_PATH)
+  uint32_t v = __atomic_load_n (&sem->value, __ATOMIC_RELAXED);
+
+  for (;;)
+    if (v >= SEM_ONE)
+      {
+	if (__atomic_compare_exchange_n (&sem->value, &v, v - SEM_ONE, 1,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	  return 1;
+      }
+    else if (!wait || (v & SEM_WAITER))
+      return 0;
+    else if (__atomic_compare_exchange_n (&sem->value, &v, v | SEM_WAITER, 1,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 0;
+#else
+  if (sem->value >= SEM_ONE)
+    {
+      sem->value -= SEM_ONE;
+      return 1;
+    }
+
+  if (wait)
+    sem->value |= SEM_WAITER;
+  return 0;
+#endif
+}
+
+/*
+ * Check if SEM has a count, without taking it.  Returns 1 if so.
+ * Otherwise, returns 0 with SEM_WAITER bit set.  Called with schedule
+ * lock held.
+ */
+static int
+chx_sem_check (chopstx_sem_t *sem)
+{
+#if defined(CHX_SEM_FAST_PATH)
+  uint32_t v = __atomic_load_n (&sem->value, __ATOMIC_RELAXED);
+
+  while (v < SEM_ONE)
+    if ((v & SEM_WAITER)
+	|| __atomic_compare_exchange_n (&sem->value, &v, v | SEM_WAITER, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 0;
+  return 1;
+#else
+  if (sem->value >= SEM_ONE)
+    return 1;
+
+  sem->value |= SEM_WAITER;
+  return 0;
+#endif
+}
+
+/* Add a count to SEM.  Returns the old value.  */
+static uint32_t
+chx_sem_add (chopstx_sem_t *sem)
+{
+#if defined(CHX_SEM_FAST_PATH)
+  return __atomic_fetch_add (&sem->value, SEM_ONE, __ATOMIC_RELEASE);
+#else
+  uint32_t v = sem->value;
+
+  sem->value = v + SEM_ONE;
+  return v;
+#endif
+}
+
+/*
+ * Wake up waiters of SEM after a count is added.  A thread takes the
+ * count when woken up.  Returns 1 when rescheduling is needed.
+ * *PRIO_P is updated with the priority of a thread woken up.  Called
+ * with schedule lock held (or, from interrupt handler).
+ */
+static int
+chx_sem_wakeup (chopstx_sem_t *sem, uint16_t *prio_p)
+{
+  struct chx_pq *p;
+  int yield = 0;
+
+  p = chx_wakeup_proxies (&sem->q, prio_p, &yield);
+  if (p)
+    {
+      if (chx_sem_take (sem, 0))
+	yield |= chx_wakeup (p);
+      else
+	{			/* Taken by another, keep waiting.  */
+	  chx_spin_lock (&sem->q.lock);
+	  ll_prio_enqueue (p, &sem->q.q);
+	  chx_spin_unlock (&sem->q.lock);
+	}
+    }
+
+  chx_spin_lock (&sem->q.lock);
+  if (sem->q.q.next == (struct chx_pq *)&sem->q.q)
+#if defined(CHX_SEM_FAST_PATH)
+    __atomic_fetch_and (&sem->value, ~SEM_WAITER, __ATOMIC_RELAXED);
+#else
+    sem->value &= ~SEM_WAITER;
+#endif
+  chx_spin_unlock (&sem->q.lock);
+  return yield;
+}
+
+
+/**
+ * chopstx_sem_init - Initialize the semaphore
+ * @sem: Semaphore
+ * @value: Initial count
+ *
+ * Initialize @sem with @value.
+ */
+void
+chopstx_sem_init (chopstx_sem_t *sem, uint32_t value)
+{
+  chopstx_cond_init (&sem->q);
+  sem->value = value * SEM_ONE;
+}
+
+
+/**
+ * chopstx_sem_post - Increment the count of the semaphore
+ * @sem: Semaphore
+ *
+ * Increment the count of @sem, and wake up a thread waiting on it.
+ * It is an atomic operation when no thread waits (with fast path).
+ */
+void
+chopstx_sem_post (chopstx_sem_t *sem)
+{
+  uint16_t prio = 0;
+
+#if defined(CHX_SEM_FAST_PATH)
+  if ((chx_sem_add (sem) & SEM_WAITER) == 0)
+    return;
+
+  chx_cpu_sched_lock ();
+#else
+  chx_cpu_sched_lock ();
+  if ((chx_sem_add (sem) & SEM_WAITER) == 0)
+    {
+      chx_cpu_sched_unlock ();
+      return;
+    }
+#endif
+
+  if (chx_sem_wakeup (sem, &prio))
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+}
+
+
+/**
+ * chopstx_sem_post_from_isr - Increment the count from interrupt handler
+ * @sem: Semaphore
+ *
+ * Increment the count of @sem, and wake up a thread waiting on it.
+ *
+ * On Cortex-M, this can be called from an interrupt handler whose
+ * priority is same as interrupts which Chopstx handles.  On GNU/Linux
+ * emulation, this is same as chopstx_sem_post, except in a callback of
+ * software timer without work queue.
+ */
+void
+chopstx_sem_post_from_isr (chopstx_sem_t *sem)
+{
+  uint16_t prio = 0;
+
+#ifdef GNU_LINUX_EMULATION
+  if (!swtimer_in_callback)
+    {
+      chopstx_sem_post (sem);
+      return;
+    }
+#endif
+  if ((chx_sem_add (sem) & SEM_WAITER) == 0)
+    return;
+
+  if (chx_sem_wakeup (sem, &prio))
+    chx_request_preemption_from_isr (prio);
+}
+
+
+/**
+ * chopstx_sem_trywait - Decrement the count of the semaphore, if possible
+ * @sem: Semaphore
+ *
+ * Decrement the count of @sem, without waiting.  Returns 1 on success,
+ * 0 when the count is zero.
+ */
+int
+chopstx_sem_trywait (chopstx_sem_t *sem)
+{
+#if defined(CHX_SEM_FAST_PATH)
+  return chx_sem_take (sem, 0);
+#else
+  int r;
+
+  chx_cpu_sched_lock ();
+  r = chx_sem_take (sem, 0);
+  chx_cpu_sched_unlock ();
+  return r;
+#endif
+}
+
+
+/**
+ * chopstx_sem_wait - Decrement the count of the semaphore
+ * @sem: Semaphore
+ *
+ * Decrement the count of @sem.  Wait while the count is zero.
+ */
+void
+chopstx_sem_wait (chopstx_sem_t *sem)
+{
+  struct chx_thread *tp = running;
+  int r;
+
+  chopstx_testcancel ();
+#if defined(CHX_SEM_FAST_PATH)
+  if (chx_sem_take (sem, 0))
+    return;
+#endif
+
+  chx_cpu_sched_lock ();
+  if (chx_sem_take (sem, 1))
+    {
+      chx_cpu_sched_unlock ();
+      return;
+    }
+
+  chx_spin_lock (&sem->q.lock);
+  ll_prio_enqueue ((struct chx_pq *)tp, &sem->q.q);
+  /* Same as condition variable, so that it can be canceled.  */
+  tp->state = THREAD_WAIT_CND;
+  chx_spin_unlock (&sem->q.lock);
+  r = chx_sched (CHX_SLEEP);
+
+  if (r < 0)
+    chopstx_exit (CHOPSTX_CANCELED);
+}
+
+
+/**
+ * chopstx_sem_timedwait - Decrement the count of the semaphore with timeout
+ * @sem: Semaphore
+ * @usec: Timeout in micro seconds
+ *
+ * Decrement the count of @sem.  Wait while the count is zero, up to
+ * @usec.  Returns 1 on success, 0 on timeout.
+ */
+int
+chopstx_sem_timedwait (chopstx_sem_t *sem, uint32_t usec)
+{
+  chopstx_poll_sem_t poll_desc;
+  struct chx_poll_head *pd_array[1] = { (struct chx_poll_head *)&poll_desc };
+
+  chopstx_sem_prepare_poll (sem, &poll_desc);
+  while (!chopstx_sem_trywait (sem))
+    {
+      if (usec == 0)
+	return 0;
+      chopstx_poll (&usec, 1, pd_array);
+    }
+  return 1;
+}
+
+
+/**
+ * chopstx_sem_prepare_poll - Prepare a poll descriptor
+ * @sem: Semaphore
+ * @p: Poll descriptor
+ *
+ * Prepare @p for chopstx_poll.  It becomes ready when the count of
+ * @sem is not zero.  It doesn't decrement the count, use
+ * chopstx_sem_trywait when ready.
+ */
+void
+chopstx_sem_prepare_poll (chopstx_sem_t *sem, chopstx_poll_sem_t *p)
+{
+  p->type = CHOPSTX_POLL_SEM;
+  p->ready = 0;
+  p->sem = sem;
+}
+
+
+static void
+chx_sem_hook (struct chx_px *px, struct chx_poll_head *pd)
+{
+  struct chx_poll_sem *ps = (struct chx_poll_sem *)pd;
+  chopstx_sem_t *sem = ps->sem;
+
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+  if (chx_sem_check (sem))
+    {
+      chx_spin_lock (&px->lock);
+      chx_proxy_ready (px);
+      chx_spin_unlock (&px->lock);
+    }
+  else
+    {
+      chx_spin_lock (&sem->q.lock);
+      ll_prio_enqueue ((struct chx_pq *)px, &sem->q.q);
+      chx_spin_unlock (&sem->q.lock);
+    }
+  chx_cpu_sched_unlock ();
+}
+
+
+/**
+ * chopstx_cleanup_push - Register a clean-up
+ * @clp: Pointer to clean-up structure
+ *
+ * Register a clean-up structure.
+ */
+void
+chopstx_cleanup_push (struct chx_cleanup *clp)
+{
+  clp->next = running->clp;
+  running->clp = clp;
+}
+
+/**
+ * chopstx_cleanup_pop - Release a clean-up
+ * @execute: Execute the clen-up function on release
+ *
+ * Unregister a clean-up structure.  When @execute is non-zero, the
+ * clean-up will be executed.
+ */
+void
+chopstx_cleanup_pop (int execute)
+{
+  struct chx_cleanup *clp = running->clp;
+
+  if (clp)
+    {
+      running->clp = clp->next;
+      if (execute)
+	clp->routine (clp->arg);
+    }
+}
+
+
+/**
+ * chopstx_exit - Terminate the execution of running thread
+ * @retval: Return value (to be caught by a joining thread)
+ *
+ * Calling this function terminates the execution of running thread,
+ * after calling clean up functions.  If the calling thread still
+ * holds mutexes (or reader-writer locks exclusively), they will be
+ * released.  This function never
+ * returns.
+ */
+void
+chopstx_exit (void *retval)
+{
+  struct chx_mtx *m, *m_next;
+  struct chx_cleanup *clp = running->clp;
+
+  running->clp = NULL;
+  while (clp)
+    {
+      clp->routine (clp->arg);
+      clp = clp->next;
+    }
+
+  /* Release all mutexes this thread still holds.  */
+  for (m = running->mutex_list; m; m = m_next)
+    {
+      m_next = m->list;
+
+      chx_cpu_sched_lock ();
+      chx_spin_lock (&m->lock);
+      chx_mutex_unlock (m);
+      chx_spin_unlock (&m->lock);
+      chx_cpu_sched_unlock ();
+    }
+
+#if defined(CHX_CPU_BUDGET)
+  if (running->budget)
+    {
+      chx_cpu_sched_lock ();
+      chx_budget_detach (running->budget);
+      chx_cpu_sched_unlock ();
+    }
+#endif
+
+  chx_exit (retval);
+}
+
+
+/**
+ * chopstx_join - join with a terminated thread
+ * @thd: Thread to wait
+ * @ret: Pointer to void * to store return value
+ *
+ * Waits for the thread of @thd to terminate.
+ * Returns 0 on success, 1 when waiting is interrupted.
+ */
+int
+chopstx_join (chopstx_t thd, void **ret)
+{
+  struct chx_thread *tp = (struct chx_thread *)thd;
+  int r = 0;
+
+  /*
+   * We don't offer deadlock detection.  It's users' responsibility.
+   */
+
+  chopstx_testcancel ();
+
+  chx_cpu_sched_lock ();
+  if (tp->flag_detached)
+    {
+      chx_cpu_sched_unlock ();
+      chx_fatal (CHOPSTX_ERR_JOIN);
+    }
+
+  if (tp->state != THREAD_EXITED)
+    {
+      struct chx_thread *tp0 = tp;
+
+      chx_spin_lock (&q_join.lock);
+      ll_prio_enqueue ((struct chx_pq *)running, &q_join.q);
+      running->v = (uintptr_t)tp;
+      running->state = THREAD_WAIT_EXIT;
+      tp->flag_join_req = 1;
+
+      /* Priority inheritance.  */
+      tp0 = tp;
+      while (tp0 && tp0->prio < running->prio)
+	{
+	  tp0->prio = running->prio;
+	  tp0 = requeue (tp0);
+	}
+      chx_spin_unlock (&q_join.lock);
+      r = chx_sched (CHX_SLEEP);
+    }
+  else
+    chx_cpu_sched_unlock ();
+
+  if (r < 0)
+    chopstx_exit (CHOPSTX_CANCELED);
+
+#if defined(CHX_THREAD_LIST)
+  chx_cpu_sched_lock ();
+  chx_thread_unlink (tp);
+  chx_cpu_sched_unlock ();
+#endif
+
+  if (r == 0)
+    {
+      tp->state = THREAD_FINISHED;
+      if (ret)
+	*ret = (void *)tp->v;
+    }
+
+  return r;
+}
+
+
+static void
+chx_join_hook (struct chx_px *px, struct chx_poll_head *pd)
+{
+  struct chx_poll_join *pj = (struct chx_poll_join *)pd;
+  struct chx_thread *tp = (struct chx_thread *)pj->thd;
+
+  chopstx_testcancel ();
+  chx_cpu_sched_lock ();
+
+  if (tp->flag_detached)
+    {
+      chx_cpu_sched_unlock ();
+      chx_fatal (CHOPSTX_ERR_JOIN);
+    }
+
+  if (tp->state == THREAD_EXITED)
+    {
+      chx_spin_lock (&px->lock);
+      chx_proxy_ready (px);
+      chx_spin_unlock (&px->lock);
+    }
+  else
+    { /* Not yet exited.
+       * Register the proxy to wait for TP's exit.
+       */
+      px->v = (uintptr_t)tp;
+      chx_spin_lock (&q_join.lock);
+      ll_prio_enqueue ((struct chx_pq *)px, &q_join.q);
+      chx_spin_unlock (&q_join.lock);
+      tp->flag_join_req = 1;
+    }
+  chx_cpu_sched_unlock ();
+}
+
+
+/**
+ * chopstx_cancel - request a cancellation to a thread
+ * @thd: Thread to be canceled
+ *
+ * This function requests a cancellation of a thread @thd.
+ * No return value.
+ */
+void
+chopstx_cancel (chopstx_t thd)
+{
+  struct chx_thread *tp = (struct chx_thread *)thd;
+
+  chx_cpu_sched_lock ();
+  tp->flag_got_cancel = 1;
+  if (!tp->flag_cancelable)
+    {
+      chx_cpu_sched_unlock ();
+      return;
+    }
+
+  /* Cancellation points: cond_wait, usec_wait, join, and poll.  */
+  if (tp->state == THREAD_WAIT_CND)
+    {
+      struct chx_cond *cond = (struct chx_cond *)tp->parent;
+
+      chx_spin_lock (&cond->lock);
+      ll_dequeue ((struct chx_pq *)tp);
+      chx_spin_unlock (&cond->lock);
+    }
+  else if (tp->state == THREAD_WAIT_TIME)
+    chx_timer_dequeue (tp);
+  else if (tp->state == THREAD_WAIT_EXIT)
+    {
+      chx_spin_lock (&q_join.lock);
+      ll_dequeue ((struct chx_pq *)tp);
+      chx_spin_unlock (&q_join.lock);
+    }
+  else if (tp->state == THREAD_WAIT_POLL)
+    {
+      if (tp->parent == &q_timer.q)
+	chx_timer_dequeue (tp);
+    }
+  else
+    {
+      chx_cpu_sched_unlock ();
+      return;
+    }
+
+  tp->v = (uintptr_t)-1;
+  chx_ready_enqueue (tp);
+  if (tp->prio > running->prio)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+}
+
+
+/**
+ * chopstx_testcancel - catch pending cancellation request
+ *
+ * Calling chopstx_testcancel creates a cancellation point.
+ * No return value.  If the thread is canceled, this function
+ * does not return.
+ */
+void
+chopstx_testcancel (void)
+{
+  if (running->flag_cancelable && running->flag_got_cancel)
+    chopstx_exit (CHOPSTX_CANCELED);
+}
+
+
+/**
+ * chopstx_setcancelstate - set cancelability state
+ * @cancel_disable: 0 to enable cancelation, otherwise disabled.
+ *
+ * Calling chopstx_setcancelstate sets cancelability state.
+ *
+ * Returns old state which is 0 when it was enabled.
+ */
+int
+chopstx_setcancelstate (int cancel_disable)
+{
+  int old_state = !running->flag_cancelable;
+
+  running->flag_cancelable = (cancel_disable == 0);
+  chopstx_testcancel ();
+  return old_state;
+}
+
+static void
+chx_proxy_init (struct chx_px *px, uint32_t *cp)
+{
+  px->next = px->prev = (struct chx_pq *)px;
+  px->flag_is_proxy = 1;
+  px->flag_in_pollset = 0;
+  px->prio = running->prio;
+  px->parent = NULL;
+  px->v = 0;
+  px->master = running;
+  px->counter_p = cp;
+  px->ready_p = NULL;
+  chx_spin_init (&px->lock);
+}
+
+
+/*
+ * Make the proxy PX ready.  Returns the thread to be woken up (or
+ * NULL).  Called with schedule lock held.
+ */
+static struct chx_thread *
+chx_proxy_ready (struct chx_px *px)
+{
+  (*px->counter_p)++;
+  *px->ready_p = 1;
+  if (px->flag_in_pollset)
+    {
+      struct chx_pollset_entry *e = (struct chx_pollset_entry *)px;
+      struct chx_pollset *ps = e->set;
+
+      e->next = NULL;
+      *ps->ready_tail = e;
+      ps->ready_tail = &e->next;
+      return ps->master;
+    }
+
+  return px->master;
+}
+
+/* Register the proxy PX to wait for the poll descriptor PD.  */
+static void
+chx_proxy_hook (struct chx_px *px, struct chx_poll_head *pd)
+{
+  if (pd->type == CHOPSTX_POLL_COND)
+    chx_cond_hook (px, pd);
+  else if (pd->type == CHOPSTX_POLL_INTR)
+    chx_intr_hook (px, pd);
+  else if (pd->type == CHOPSTX_POLL_MQUEUE)
+    chx_mqueue_hook (px, pd);
+  else if (pd->type == CHOPSTX_POLL_SEM)
+    chx_sem_hook (px, pd);
+  else
+    chx_join_hook (px, pd);
+}
+
+/*
+ * Unregister the proxy PX for PD, if not ready.  If ready, finish the
+ * event.  Called with schedule lock held.
+ */
+static void
+chx_proxy_unhook (struct chx_px *px, struct chx_poll_head *pd)
+{
+  if (pd->type == CHOPSTX_POLL_COND)
+    {
+      struct chx_poll_cond *pc = (struct chx_poll_cond *)pd;
+
+      if (pc->ready == 0)
+	{
+	  chx_spin_lock (&pc->cond->lock);
+	  ll_dequeue ((struct chx_pq *)px);
+	  chx_spin_unlock (&pc->cond->lock);
+	}
+    }
+  else if (pd->type == CHOPSTX_POLL_INTR)
+    {
+      struct chx_intr *intr = (struct chx_intr *)pd;
+
+      if (intr->ready)
+	chx_clr_intr (intr->irq_num);
+      else
+	{
+	  chx_spin_lock (&q_intr.lock);
+	  ll_dequeue ((struct chx_pq *)px);
+	  chx_spin_unlock (&q_intr.lock);
+	  chx_disable_intr (intr->irq_num);
+	}
+    }
+  else if (pd->type == CHOPSTX_POLL_MQUEUE)
+    {
+      struct chx_poll_mqueue *pm = (struct chx_poll_mqueue *)pd;
+      struct chx_cond *q = pm->send ? &pm->mq->send : &pm->mq->recv;
+
+      if (pm->ready == 0)
+	{
+	  chx_spin_lock (&q->lock);
+	  ll_dequeue ((struct chx_pq *)px);
+	  chx_spin_unlock (&q->lock);
+	}
+    }
+  else if (pd->type == CHOPSTX_POLL_SEM)
+    {
+      struct chx_poll_sem *ps = (struct chx_poll_sem *)pd;
+
+      if (ps->ready == 0)
+	{
+	  chx_spin_lock (&ps->sem->q.lock);
+	  ll_dequeue ((struct chx_pq *)px);
+	  chx_spin_unlock (&ps->sem->q.lock);
+	}
+    }
+  else
+    {
+      struct chx_poll_join *pj = (struct chx_poll_join *)pd;
+
+      if (pj->ready == 0)
+	{
+	  chx_spin_lock (&q_join.lock);
+	  ll_dequeue ((struct chx_pq *)px);
+	  chx_spin_unlock (&q_join.lock);
+	}
+    }
+}
+
+
+/*
+ * Wait for poll descriptors until *DEADLINE_P (in ticks).  Forever if
+ * DEADLINE_P is NULL.
+ */
+static int
+chx_poll (const uint64_t *deadline_p, int n, struct chx_poll_head *pd_array[])
+{
+  uint32_t counter = 0;
+  int i;
+  struct chx_px px[n];
+  struct chx_poll_head *pd;
+  int r = 0;
+
+  chopstx_testcancel ();
+
+  for (i = 0; i < n; i++)
+    chx_proxy_init (&px[i], &counter);
+
+  for (i = 0; i < n; i++)
+    {
+      pd = pd_array[i];
+      pd->ready = 0;
+      px[i].ready_p = &pd->ready;
+      chx_proxy_hook (&px[i], pd);
+    }
+
+  chx_cpu_sched_lock ();
+  chx_spin_lock (&px->lock);
+  if (counter)
+    {
+      chx_spin_unlock (&px->lock);
+      chx_cpu_sched_unlock ();
+    }
+  else if (deadline_p == NULL)
+    {
+      running->state = THREAD_WAIT_POLL;
+      chx_spin_unlock (&px->lock);
+      r = chx_sched (CHX_SLEEP);
+    }
+  else
+    {
+      chx_spin_unlock (&px->lock);
+      r = chx_snooze (THREAD_WAIT_POLL, *deadline_p);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      pd = pd_array[i];
+      chx_cpu_sched_lock ();
+      chx_spin_lock (&px[i].lock);
+      chx_proxy_unhook (&px[i], pd);
+      chx_spin_unlock (&px[i].lock);
+      chx_cpu_sched_unlock ();
+    }
+
+  if (r < 0)
+    chopstx_exit (CHOPSTX_CANCELED);
+
+  return counter;
+}
+
+
+/**
+ * chopstx_poll - wait for condition variable, thread's exit, or IRQ
+ * @usec_p: Pointer to usec for timeout.  Forever if NULL.
+ * @n: Number of poll descriptors
+ * @pd_array: Pointer to an array of poll descriptor pointer which
+ * should be one of:
+ *           chopstx_poll_cond_t, chopstx_poll_join_t, chopstx_intr_t,
+ *           chopstx_poll_mqueue_t, or chopstx_poll_sem_t.
+ *
+ * Returns number of active descriptors.  When @usec_p is not NULL,
+ * remaining usec is stored into *@usec_p.
+ */
+int
+chopstx_poll (uint32_t *usec_p, int n, struct chx_poll_head *pd_array[])
+{
+  uint64_t deadline, now;
+  int r;
+
+  if (usec_p == NULL)
+    return chx_poll (NULL, n, pd_array);
+
+  deadline = chx_clock_get () + usec_to_ticks (*usec_p);
+  r = chx_poll (&deadline, n, pd_array);
+  now = chx_clock_get ();
+  if ((int64_t)(deadline - now) > 0)
+    *usec_p = (uint32_t)((deadline - now) / MHZ);
+  else
+    *usec_p = 0;
+
+  return r;
+}
+
+
+/**
+ * chopstx_poll_until - wait for condition variable, thread's exit, or IRQ
+ * @usec: Time in micro seconds (of chopstx_clock_gettime) for timeout
+ * @n: Number of poll descriptors
+ * @pd_array: Pointer to an array of poll descriptor pointer which
+ * should be one of:
+ *           chopstx_poll_cond_t, chopstx_poll_join_t, chopstx_intr_t,
+ *           chopstx_poll_mqueue_t, or chopstx_poll_sem_t.
+ *
+ * Same as chopstx_poll, but its timeout is specified by the time.
+ * Returns number of active descriptors.
+ */
+int
+chopstx_poll_until (uint64_t usec, int n, struct chx_poll_head *pd_array[])
+{
+  uint64_t deadline = usec * MHZ;
+
+  return chx_poll (&deadline, n, pd_array);
+}
+
+
+/*
+ * Hook the entry E again (or, for the first time).
+ */
+static void
+chx_pollset_arm (struct chx_pollset_entry *e)
+{
+  e->pd->ready = 0;
+  e->armed = 1;
+  chx_proxy_hook ((struct chx_px *)e->px, e->pd);
+}
+
+
+/**
+ * chopstx_pollset_init - Initialize the poll set
+ * @ps: Poll set
+ *
+ * Initialize @ps.  A poll set is used by a single thread at a time.
+ */
+void
+chopstx_pollset_init (chopstx_pollset_t *ps)
+{
+  ps->ready = NULL;
+  ps->ready_tail = &ps->ready;
+  ps->rearm = NULL;
+  ps->list = NULL;
+  ps->master = NULL;
+  ps->counter = 0;
+  ps->prio = running->prio;
+}
+
+
+/**
+ * chopstx_pollset_add - Register a poll descriptor to the poll set
+ * @ps: Poll set
+ * @e: Entry for @pd
+ * @pd: Poll descriptor
+ *
+ * Register @pd to @ps, using @e.  @pd stays registered until
+ * chopstx_pollset_remove, and it is waited for by
+ * chopstx_pollset_wait.  The priority of the thread calling
+ * chopstx_pollset_wait is used for the wait.
+ */
+void
+chopstx_pollset_add (chopstx_pollset_t *ps, chopstx_pollset_entry_t *e,
+		     struct chx_poll_head *pd)
+{
+  struct chx_px *px = (struct chx_px *)e->px;
+
+  chx_proxy_init (px, &ps->counter);
+  px->flag_in_pollset = 1;
+  px->prio = ps->prio;
+  px->master = NULL;
+  px->ready_p = &pd->ready;
+  e->set = ps;
+  e->next = NULL;
+  e->pd = pd;
+  e->link = ps->list;
+  ps->list = e;
+  chx_pollset_arm (e);
+}
+
+
+/*
+ * Unhook the armed entry E of PS.  If it's ready, remove it from the
+ * ready list.  Called with schedule lock held.
+ */
+static void
+chx_pollset_disarm (struct chx_pollset *ps, struct chx_pollset_entry *e)
+{
+  struct chx_px *px = (struct chx_px *)e->px;
+  struct chx_pollset_entry **pp;
+
+  chx_spin_lock (&px->lock);
+  chx_proxy_unhook (px, e->pd);
+  chx_spin_unlock (&px->lock);
+  if (e->pd->ready)
+    {				/* Remove from the ready list.  */
+      for (pp = &ps->ready; *pp != e; pp = &(*pp)->next)
+	;
+      *pp = e->next;
+      if (ps->ready_tail == &e->next)
+	ps->ready_tail = pp;
+    }
+  e->armed = 0;
+}
+
+
+/**
+ * chopstx_pollset_remove - Unregister a poll descriptor from the poll set
+ * @ps: Poll set
+ * @e: Entry used by chopstx_pollset_add
+ *
+ * Unregister the poll descriptor of @e from @ps.
+ */
+void
+chopstx_pollset_remove (chopstx_pollset_t *ps, chopstx_pollset_entry_t *e)
+{
+  struct chx_pollset_entry **pp;
+
+  chx_cpu_sched_lock ();
+  if (e->armed)
+    chx_pollset_disarm (ps, e);
+  else
+    {
+      for (pp = &ps->rearm; *pp != e; pp = &(*pp)->next)
+	;
+      *pp = e->next;
+    }
+  for (pp = &ps->list; *pp != e; pp = &(*pp)->link)
+    ;
+  *pp = e->link;
+  chx_cpu_sched_unlock ();
+}
+
+
+/**
+ * chopstx_pollset_destroy - Unregister all poll descriptors
+ * @ps: Poll set
+ *
+ * Unregister all poll descriptors from @ps.  Registered entries are
+ * hooked to the objects of poll descriptors, even when no thread
+ * waits for @ps.  So, this must be called before @ps or its entries
+ * go away.  When the thread waiting for @ps is canceled, this is
+ * called automatically.  @ps can be used again after
+ * chopstx_pollset_init.
+ */
+void
+chopstx_pollset_destroy (chopstx_pollset_t *ps)
+{
+  struct chx_pollset_entry *e;
+
+  chx_cpu_sched_lock ();
+  for (e = ps->list; e; e = e->link)
+    if (e->armed)
+      chx_pollset_disarm (ps, e);
+  ps->ready = NULL;
+  ps->ready_tail = &ps->ready;
+  ps->rearm = NULL;
+  ps->list = NULL;
+  chx_cpu_sched_unlock ();
+}
+
+static void
+chx_pollset_cleanup (void *arg)
+{
+  chopstx_pollset_destroy ((chopstx_pollset_t *)arg);
+}
+
+
+/*
+ * Change the priority of the proxies of PS to PRIO.  Entries waiting
+ * in a queue are unhooked and put to the list to be hooked again, so
+ * that they are queued by the new priority.  Called with schedule
+ * lock held.
+ */
+static void
+chx_pollset_set_prio (struct chx_pollset *ps, uint8_t prio)
+{
+  struct chx_pollset_entry *e;
+
+  for (e = ps->list; e; e = e->link)
+    {
+      struct chx_px *px = (struct chx_px *)e->px;
+
+      px->prio = prio;
+      if (e->armed && e->pd->ready == 0)
+	{
+	  chx_pollset_disarm (ps, e);
+	  e->next = ps->rearm;
+	  ps->rearm = e;
+	}
+    }
+  ps->prio = prio;
+}
+
+
+/*
+ * Wait for the poll set PS until *DEADLINE_P (in ticks).  Forever if
+ * DEADLINE_P is NULL.
+ */
+static int
+chx_pollset_wait (chopstx_pollset_t *ps, const uint64_t *deadline_p,
+		  struct chx_poll_head *pd_array[], int n)
+{
+  struct chx_pollset_entry *e;
+  struct chx_cleanup clp;
+  int i;
+  int r = 0;
+
+  clp.routine = chx_pollset_cleanup;
+  clp.arg = ps;
+  chopstx_cleanup_push (&clp);
+  chopstx_testcancel ();
+
+  /* Proxies wait by the priority of the thread.  */
+  if (ps->prio != running->prio)
+    {
+      chx_cpu_sched_lock ();
+      chx_pollset_set_prio (ps, running->prio);
+      chx_cpu_sched_unlock ();
+    }
+
+  /* Only the entries reported by last call need to be hooked again.  */
+  while ((e = ps->rearm))
+    {
+      ps->rearm = e->next;
+      chx_pollset_arm (e);
+    }
+
+  chx_cpu_sched_lock ();
+  if (ps->ready == NULL)
+    {
+      ps->master = running;
+      if (deadline_p == NULL)
+	{
+	  running->state = THREAD_WAIT_POLL;
+	  r = chx_sched (CHX_SLEEP);
+	}
+      else
+	r = chx_snooze (THREAD_WAIT_POLL, *deadline_p);
+
+      chx_cpu_sched_lock ();
+      ps->master = NULL;
+    }
+
+  for (i = 0; i < n && (e = ps->ready); i++)
+    {
+      struct chx_px *px = (struct chx_px *)e->px;
+
+      ps->ready = e->next;
+      if (ps->ready == NULL)
+	ps->ready_tail = &ps->ready;
+      chx_spin_lock (&px->lock);
+      chx_proxy_unhook (px, e->pd);
+      chx_spin_unlock (&px->lock);
+      e->armed = 0;
+      e->next = ps->rearm;
+      ps->rearm = e;
+      pd_array[i] = e->pd;
+    }
+  chx_cpu_sched_unlock ();
+
+  if (r < 0)
+    chopstx_exit (CHOPSTX_CANCELED);
+
+  chopstx_cleanup_pop (0);
+  return i;
+}
+
+
+/**
+ * chopstx_pollset_wait - Wait for the poll set
+ * @ps: Poll set
+ * @usec_p: Pointer to usec for timeout.  Forever if NULL.
+ * @pd_array: Array to store the ready poll descriptors
+ * @n: Number of elements of @pd_array
+ *
+ * Wait until some poll descriptors of @ps are ready, and store them
+ * into @pd_array, up to @n.  Returns the number of stored poll
+ * descriptors (zero on timeout).  When @usec_p is not NULL, remaining
+ * usec is stored into *@usec_p.
+ *
+ * Returned poll descriptors are hooked again on next call, so, the
+ * cost is not for all registered descriptors but for ready ones.
+ */
+int
+chopstx_pollset_wait (chopstx_pollset_t *ps, uint32_t *usec_p,
+		      struct chx_poll_head *pd_array[], int n)
+{
+  uint64_t deadline, now;
+  int r;
+
+  if (usec_p == NULL)
+    return chx_pollset_wait (ps, NULL, pd_array, n);
+
+  deadline = chx_clock_get () + usec_to_ticks (*usec_p);
+  r = chx_pollset_wait (ps, &deadline, pd_array, n);
+  now = chx_clock_get ();
+  if ((int64_t)(deadline - now) > 0)
+    *usec_p = (uint32_t)((deadline - now) / MHZ);
+  else
+    *usec_p = 0;
+
+  return r;
+}
+
+
+/*
+ * Work queue.
+ *
+ * Pending work is on a list of the queue, and it's run by a worker in
+ * FIFO order.  Delayed work is on another list, sorted by its
+ * deadline.  Work has ->PPREV to the link to it, so that it can be
+ * removed from either list in constant time.  One of the workers (->TIMER_WORKER) sleeps on the
+ * timer until the deadline of the first delayed work, and moves
+ * expired ones to the pending list.  Other idle workers wait on the
+ * queue ->IDLE, like a condition variable, so that they can be
+ * canceled.
+ */
+#define WORK_IDLE    0
+#define WORK_PENDING 1
+#define WORK_DELAYED 2
+
+static void
+chx_work_append (chopstx_workqueue_t *wq, chopstx_work_t *work)
+{
+  work->next = NULL;
+  work->state = WORK_PENDING;
+  if (wq->tail)
+    work->pprev = &wq->tail->next;
+  else
+    work->pprev = &wq->head;
+  *work->pprev = work;
+  wq->tail = work;
+}
+
+/*
+ * Remove WORK from the list of WQ, and make it idle.  Called with
+ * schedule lock held.
+ */
+static void
+chx_work_unlink (chopstx_workqueue_t *wq, chopstx_work_t *work)
+{
+  *work->pprev = work->next;
+  if (work->next)
+    work->next->pprev = work->pprev;
+  else if (work->state == WORK_PENDING)
+    /* It was the tail.  ->NEXT is the first member of the previous.  */
+    wq->tail = wq->head ? (chopstx_work_t *)work->pprev : NULL;
+  work->next = NULL;
+  work->pprev = NULL;
+  work->state = WORK_IDLE;
+}
+
+/*
+ * Wake up a worker of WQ.  When TIMER is non-zero, it's for the change
+ * of the first delayed work, and the worker sleeping on the timer is
+ * woken up if any.  Returns the priority of the worker, or 0.  Called
+ * with schedule lock held (or, from interrupt handler).
+ */
+static uint16_t
+chx_workqueue_kick (chopstx_workqueue_t *wq, int timer)
+{
+  struct chx_thread *tp = NULL;
+
+  if (!timer || wq->timer_worker == NULL)
+    {
+      chx_spin_lock (&wq->idle.lock);
+      tp = (struct chx_thread *)ll_pop (&wq->idle.q);
+      chx_spin_unlock (&wq->idle.lock);
+    }
+
+  if (tp == NULL)
+    {
+      tp = wq->timer_worker;
+      if (tp == NULL || tp->state != THREAD_WAIT_TIME)
+	/* No worker to wake up, or it's already woken up.  */
+	return 0;
+      chx_timer_dequeue (tp);
+    }
+
+  tp->v = 1;
+  chx_ready_enqueue (tp);
+  return tp->prio;
+}
+
+/*
+ * Move expired delayed work of WQ to the pending list.  Called with
+ * schedule lock held.
+ */
+static void
+chx_workqueue_expire (chopstx_workqueue_t *wq)
+{
+  chopstx_work_t *work;
+  uint64_t now;
+
+  if (wq->delayed == NULL)
+    return;
+
+  now = chx_clock_ticks ();
+  while ((work = wq->delayed) && (int64_t)(work->deadline - now) <= 0)
+    {
+      chx_work_unlink (wq, work);
+      chx_work_append (wq, work);
+    }
+}
+
+static void *
+chx_workqueue_worker (void *arg)
+{
+  chopstx_workqueue_t *wq = arg;
+  struct chx_thread *tp = running;
+
+  chx_cpu_sched_lock ();
+  while (1)
+    {
+      chopstx_work_t *work;
+      int r;
+
+      chx_workqueue_expire (wq);
+      work = wq->head;
+      if (work)
+	{
+	  chx_work_unlink (wq, work);
+	  chx_cpu_sched_unlock ();
+	  work->func (work->arg);
+	  chx_cpu_sched_lock ();
+	  continue;
+	}
+
+      if (wq->delayed && wq->timer_worker == NULL)
+	{
+	  wq->timer_worker = tp;
+	  r = chx_snooze (THREAD_WAIT_TIME, wq->delayed->deadline);
+	  chx_cpu_sched_lock ();
+	  wq->timer_worker = NULL;
+	}
+      else
+	{
+	  chx_spin_lock (&wq->idle.lock);
+	  ll_prio_enqueue ((struct chx_pq *)tp, &wq->idle.q);
+	  /* Same as condition variable, so that it can be canceled.  */
+	  tp->state = THREAD_WAIT_CND;
+	  chx_spin_unlock (&wq->idle.lock);
+	  r = chx_sched (CHX_SLEEP);
+	  chx_cpu_sched_lock ();
+	}
+
+      if (r < 0)
+	{
+	  chx_cpu_sched_unlock ();
+	  chopstx_exit (CHOPSTX_CANCELED);
+	}
+    }
+
+  return NULL;
+}
+
+
+/**
+ * chopstx_work_init - Initialize the work item
+ * @work: Work item
+ * @func: Function to be called by a worker
+ * @arg: Argument to @func
+ *
+ * Initialize @work.
+ */
+void
+chopstx_work_init (chopstx_work_t *work, void (*func) (void *), void *arg)
+{
+  work->next = NULL;
+  work->pprev = NULL;
+  work->func = func;
+  work->arg = arg;
+  work->deadline = 0;
+  work->state = WORK_IDLE;
+}
+
+
+/**
+ * chopstx_workqueue_init - Initialize the work queue
+ * @wq: Work queue
+ *
+ * Initialize @wq.  Workers should be added by
+ * chopstx_workqueue_add_worker.
+ */
+void
+chopstx_workqueue_init (chopstx_workqueue_t *wq)
+{
+  chopstx_cond_init (&wq->idle);
+  wq->head = wq->tail = NULL;
+  wq->delayed = NULL;
+  wq->timer_worker = NULL;
+}
+
+
+/**
+ * chopstx_workqueue_add_worker - Create a worker thread of the queue
+ * @wq: Work queue
+ * @prio: Priority of the worker
+ * @stack_addr: Stack address
+ * @stack_size: Size of stack
+ *
+ * Create a thread which runs work items posted to @wq.  Returns the
+ * thread ID.  Work items are run at @prio, so, a work queue is usually
+ * for a priority, with a few workers.  A worker can be terminated by
+ * chopstx_cancel while it's idle.
+ */
+chopstx_t
+chopstx_workqueue_add_worker (chopstx_workqueue_t *wq, chopstx_prio_t prio,
+			      uintptr_t stack_addr, size_t stack_size)
+{
+  return chopstx_create (prio, stack_addr, stack_size,
+			 chx_workqueue_worker, wq);
+}
+
+
+/**
+ * chopstx_work_post - Post the work item
+ * @wq: Work queue
+ * @work: Work item
+ *
+ * Post @work to @wq, to be run by a worker.  Returns 1 on success, 0
+ * when @work is already posted (and not yet run).
+ */
+int
+chopstx_work_post (chopstx_workqueue_t *wq, chopstx_work_t *work)
+{
+  uint16_t prio;
+
+  chx_cpu_sched_lock ();
+  if (work->state != WORK_IDLE)
+    {
+      chx_cpu_sched_unlock ();
+      return 0;
+    }
+
+  chx_work_append (wq, work);
+  prio = chx_workqueue_kick (wq, 0);
+  if (prio > running->prio)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+  return 1;
+}
+
+
+/**
+ * chopstx_work_post_from_isr - Post the work item from interrupt handler
+ * @wq: Work queue
+ * @work: Work item
+ *
+ * Post @work to @wq.  Returns 1 on success, 0 when @work is already
+ * posted.
+ *
+ * On Cortex-M, this can be called from an interrupt handler whose
+ * priority is same as interrupts which Chopstx handles, that is, one
+ * which is masked by the schedule lock.  On GNU/Linux emulation, this
+ * is same as chopstx_work_post, except in a callback of software timer
+ * without work queue.
+ */
+int
+chopstx_work_post_from_isr (chopstx_workqueue_t *wq, chopstx_work_t *work)
+{
+#ifdef GNU_LINUX_EMULATION
+  if (!swtimer_in_callback)
+    return chopstx_work_post (wq, work);
+#endif
+  if (work->state != WORK_IDLE)
+    return 0;
+
+  chx_work_append (wq, work);
+  chx_request_preemption_from_isr (chx_workqueue_kick (wq, 0));
+  return 1;
+}
+
+
+/**
+ * chopstx_work_post_delayed - Post the work item after delay
+ * @wq: Work queue
+ * @work: Work item
+ * @usec: Delay in micro seconds
+ *
+ * Post @work to @wq, after @usec.  Returns 1 on success, 0 when @work
+ * is already posted.
+ */
+int
+chopstx_work_post_delayed (chopstx_workqueue_t *wq, chopstx_work_t *work,
+			   uint32_t usec)
+{
+  chopstx_work_t **wp;
+  uint16_t prio = 0;
+
+  chx_cpu_sched_lock ();
+  if (work->state != WORK_IDLE)
+    {
+      chx_cpu_sched_unlock ();
+      return 0;
+    }
+
+  work->deadline = chx_clock_ticks () + usec_to_ticks (usec);
+  work->state = WORK_DELAYED;
+  for (wp = &wq->delayed; *wp; wp = &(*wp)->next)
+    if ((int64_t)((*wp)->deadline - work->deadline) > 0)
+      break;
+  work->next = *wp;
+  if (work->next)
+    work->next->pprev = &work->next;
+  work->pprev = wp;
+  *wp = work;
+
+  if (wq->delayed == work)
+    /* The first one is changed.  */
+    prio = chx_workqueue_kick (wq, 1);
+  if (prio > running->prio)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+  return 1;
+}
+
+
+/**
+ * chopstx_work_cancel - Cancel the work item
+ * @wq: Work queue
+ * @work: Work item
+ *
+ * Remove @work from @wq, if it's not yet run.  It's done in constant
+ * time.  Returns 1 when it's removed, 0 otherwise.  Note that @work
+ * may be running when it returns 0.
+ */
+int
+chopstx_work_cancel (chopstx_workqueue_t *wq, chopstx_work_t *work)
+{
+  int r = 0;
+
+  chx_cpu_sched_lock ();
+  if (work->state != WORK_IDLE)
+    {
+      chx_work_unlink (wq, work);
+      r = 1;
+    }
+  chx_cpu_sched_unlock ();
+  return r;
+}
+
+
+/*
+ * Software timer.
+ *
+ * Its head is same as struct chx_pq, and it's linked to the timer
+ * queue with ->FLAG_IS_PROXY set.  On expiry, it's posted to its work
+ * queue, or its callback is called directly when it has no work
+ * queue.
+ */
+typedef char chx_timer_size_check[sizeof (struct chx_pq)
+				  <= sizeof (((chopstx_timer_t *)0)->pq)
+				  ? 1 : -1];
+
+/*
+ * Fire software timers on the list EXPIRED.  Called from
+ * chx_timer_expired.  Returns the priority for preemption, which is
+ * PRIO or higher.
+ */
+static uint16_t
+chx_swtimer_fire (chopstx_timer_t *expired, uint16_t prio)
+{
+  swtimer_prio = prio;
+  while (expired)
+    {
+      chopstx_timer_t *timer = expired;
+
+      expired = timer->next;
+      if (timer->wq == NULL)
+	{
+	  swtimer_in_callback = 1;
+	  timer->work.func (timer->work.arg);
+	  swtimer_in_callback = 0;
+	}
+      else if (timer->work.state == WORK_IDLE)
+	{
+	  uint16_t prio_w;
+
+	  chx_work_append (timer->wq, &timer->work);
+	  prio_w = chx_workqueue_kick (timer->wq, 0);
+	  if (swtimer_prio < prio_w)
+	    swtimer_prio = prio_w;
+	}
+      /* Otherwise, the last one is not yet done.  Skip this.  */
+    }
+
+  return swtimer_prio;
+}
+
+/*
+ * Remove TIMER from the timer queue.  Called with schedule lock held.
+ * Returns 1 when it's removed.
+ */
+static int
+chx_swtimer_remove (chopstx_timer_t *timer)
+{
+  struct chx_pq *p = (struct chx_pq *)timer->pq;
+  int r = 0;
+
+  chx_spin_lock (&q_timer.lock);
+  if (p->parent == &q_timer.q)
+    {
+      uint32_t expiry = p->v;
+
+      timer_remove (p);
+      if (expiry == timer_next)
+	timer_program_next (chx_timer_now ());
+      r = 1;
+    }
+  chx_spin_unlock (&q_timer.lock);
+  return r;
+}
+
+
+/*
+ * Link TIMER to the timer queue, to expire at DEADLINE, and then,
+ * every PERIOD when it's not 0 (both in ticks).  Called with schedule
+ * lock held.
+ */
+static void
+chx_swtimer_link (chopstx_timer_t *timer, uint64_t deadline,
+		  uint64_t period, uint64_t now)
+{
+  uint32_t ticks;
+
+  chx_spin_lock (&q_timer.lock);
+  timer->deadline = deadline;
+  timer->period = period;
+  ticks = timer_link ((struct chx_pq *)timer->pq, deadline, now);
+  if (ticks)
+    chx_timer_program (ticks);
+  chx_spin_unlock (&q_timer.lock);
+}
 
 
 /**
- * chopstx_setcancelstate - set cancelability state
- * @cancel_disable: 0 to enable cancelation, otherwise disabled.
+ * chopstx_timer_init - Initialize the software timer
+ * @timer: Software timer
+ * @func: Function to be called on expiry
+ * @arg: Argument to @func
+ * @wq: Work queue, or NULL
  *
- * Calling chopstx_setcancelstate sets cancelability state.
+ * Initialize @timer.  When @wq is not NULL, @func is called by a worker
+ * of @wq.  Otherwise, @func is called in interrupt context, and it
+ * should be short, and it can only call *_from_isr functions of
+ * Chopstx.
+ */
+void
+chopstx_timer_init (chopstx_timer_t *timer, void (*func) (void *),
+		    void *arg, chopstx_workqueue_t *wq)
+{
+  struct chx_pq *p = (struct chx_pq *)timer->pq;
+
+  p->next = p->prev = p;
+  p->flag_is_proxy = 1;
+  p->prio = 0;
+  p->parent = NULL;
+  p->v = 0;
+  timer->next = NULL;
+  timer->deadline = 0;
+  timer->period = 0;
+  timer->wq = wq;
+  chopstx_work_init (&timer->work, func, arg);
+}
+
+
+/**
+ * chopstx_timer_start - Start the software timer
+ * @timer: Software timer
+ * @usec: Time to first expiry, in micro seconds
+ * @period_usec: Period in micro seconds, or 0 for one-shot
  *
- * Returns old state which is 0 when it was enabled.
+ * Start @timer.  When it's already started, it's started again.
+ * A periodic timer expires at @usec + N * @period_usec, without drift.
+ * When its previous work is not yet done on its work queue, an expiry
+ * is skipped.
+ */
+void
+chopstx_timer_start (chopstx_timer_t *timer, uint32_t usec,
+		     uint32_t period_usec)
+{
+  uint64_t now;
+
+  chx_cpu_sched_lock ();
+  chx_swtimer_remove (timer);
+  now = chx_clock_ticks ();
+  chx_swtimer_link (timer, now + usec_to_ticks (usec),
+		    usec_to_ticks (period_usec), now);
+  chx_cpu_sched_unlock ();
+}
+
+
+/**
+ * chopstx_timer_stop - Stop the software timer
+ * @timer: Software timer
+ *
+ * Stop @timer, and cancel its work if not yet run.  Both are done in
+ * constant time.  Returns 1 when it was active, 0 otherwise.
  */
 int
-chopstx_setcancelstate (int cancel_disable)
+chopstx_timer_stop (chopstx_timer_t *timer)
 {
-  int old_state = !running->flag_cancelable;
+  int r;
 
-  running->flag_cancelable = (cancel_disable == 0);
-  chopstx_testcancel ();
-  return old_state;
+  chx_cpu_sched_lock ();
+  r = chx_swtimer_remove (timer);
+  chx_cpu_sched_unlock ();
+  if (timer->wq)
+    r |= chopstx_work_cancel (timer->wq, &timer->work);
+  return r;
 }
 
+
+#if defined(CHX_CPU_BUDGET)
+/*
+ * CPU budget.
+ *
+ * The run time of the thread with budget is charged when it's
+ * switched out, in chx_ready_pop.  While it runs, BUDGET_TIMER is on
+ * the timer queue for the remaining budget.  On its expiry, the
+ * thread is demoted to the background priority.  The timer of
+ * struct chx_budget replenishes the budget and restores the priority
+ * every period.  Both are handled in interrupt context, like
+ * callbacks of software timers without work queue.
+ */
+static chopstx_timer_t budget_timer;
+static struct chx_budget *budget_cur; /* Budget of running thread.  */
+static uint64_t budget_start;	      /* Ticks when it's charged last.  */
+
+static void chx_budget_expired (void *arg);
+
 static void
-chx_proxy_init (struct chx_px *px, uint32_t *cp)
+chx_budget_init (void)
 {
-  px->next = px->prev = (struct chx_pq *)px;
-  px->flag_is_proxy = 1;
-  px->prio = running->prio;
-  px->parent = NULL;
-  px->v = 0;
-  px->master = running;
-  px->counter_p = cp;
-  px->ready_p = NULL;
-  chx_spin_init (&px->lock);
+  chopstx_timer_init (&budget_timer, chx_budget_expired, NULL, NULL);
 }
 
+/* Charge the run time of running thread to its budget.  */
+static void
+chx_budget_charge (uint64_t now)
+{
+  uint64_t used = now - budget_start;
 
-/**
- * chopstx_poll - wait for condition variable, thread's exit, or IRQ
- * @usec_p: Pointer to usec for timeout.  Forever if NULL.
- * @n: Number of poll descriptors
- * @pd_array: Pointer to an array of poll descriptor pointer which
- * should be one of:
- *           chopstx_poll_cond_t, chopstx_poll_join_t, or chopstx_intr_t.
- *
- * Returns number of active descriptors.
+  if (budget_cur->remain > used)
+    budget_cur->remain -= used;
+  else
+    budget_cur->remain = 0;
+  budget_start = now;
+}
+
+/*
+ * Switch the budget to charge, to the one of TP (NULL for idle).
+ * Called by chx_ready_pop, with schedule lock held.
  */
-int
-chopstx_poll (uint32_t *usec_p, int n, struct chx_poll_head *pd_array[])
+static void
+chx_budget_switch (struct chx_thread *tp)
 {
-  uint32_t counter = 0;
-  int i;
-  struct chx_px px[n];
-  struct chx_poll_head *pd;
-  int r = 0;
+  struct chx_budget *b = tp ? tp->budget : NULL;
+  uint64_t now;
 
-  chopstx_testcancel ();
+  if (budget_cur == NULL && b == NULL)
+    return;
 
-  for (i = 0; i < n; i++)
-    chx_proxy_init (&px[i], &counter);
+  now = chx_clock_ticks ();
+  if (budget_cur)
+    {
+      chx_budget_charge (now);
+      chx_swtimer_remove (&budget_timer);
+    }
 
-  for (i = 0; i < n; i++)
+  budget_cur = b;
+  budget_start = now;
+  if (b && !b->demoted)
+    chx_swtimer_link (&budget_timer, now + b->remain, 0, now);
+}
+
+/*
+ * Restore the priority of the thread of B, demoted.  Returns the
+ * priority for preemption, or 0.
+ */
+static uint16_t
+chx_budget_restore (struct chx_budget *b)
+{
+  struct chx_thread *tp = b->thd;
+
+  b->demoted = 0;
+  tp->prio_orig = b->prio_orig;
+  if (tp->prio >= tp->prio_orig)
+    return 0;
+
+  tp->prio = tp->prio_orig;
+  if (tp == running)
+    return 0;
+
+  requeue (tp);
+  if (tp->state == THREAD_WAIT_MTX)
+    chx_mutex_inherit ((chopstx_mutex_t *)tp->parent, tp);
+  return tp->prio;
+}
+
+/*
+ * Callback of BUDGET_TIMER: the budget of running thread is exhausted.
+ * Demote the thread.  When it holds a mutex with priority inheritance
+ * active, it keeps the inherited priority until it unlocks.
+ */
+static void
+chx_budget_expired (void *arg)
+{
+  struct chx_budget *b = budget_cur;
+  struct chx_thread *tp;
+  uint64_t now = chx_clock_ticks ();
+
+  (void)arg;
+  if (b == NULL || b->demoted)
+    return;
+
+  chx_budget_charge (now);
+  if (b->remain)
+    {				/* Not yet, by rounding.  */
+      chx_swtimer_link (&budget_timer, now + b->remain, 0, now);
+      return;
+    }
+
+  b->exhausted++;
+  b->demoted = 1;
+  tp = b->thd;
+  b->prio_orig = tp->prio_orig;
+  if (tp->prio_orig <= b->prio_bg)
+    return;
+
+  if (tp->prio == tp->prio_orig)
+    /* No priority inheritance is active.  */
+    tp->prio = b->prio_bg;
+  tp->prio_orig = b->prio_bg;
+
+  chx_spin_lock (&q_ready.lock);
+  if (!ready_preempts (tp))
+    chx_request_preemption_from_isr (MAX_PRIO);
+  chx_spin_unlock (&q_ready.lock);
+}
+
+/* Callback of the timer of budget B: replenish.  */
+static void
+chx_budget_replenish (void *arg)
+{
+  struct chx_budget *b = arg;
+  uint64_t now = chx_clock_ticks ();
+
+  b->remain = b->budget;
+  if (b->demoted)
+    chx_request_preemption_from_isr (chx_budget_restore (b));
+
+  if (b == budget_cur)
     {
-      pd = pd_array[i];
-      pd->ready = 0;
-      px[i].ready_p = &pd->ready;
-      if (pd->type == CHOPSTX_POLL_COND)
-	chx_cond_hook (&px[i], pd);
-      else if (pd->type == CHOPSTX_POLL_INTR)
-	chx_intr_hook (&px[i], pd);
-      else
-	chx_join_hook (&px[i], pd);
+      budget_start = now;
+      chx_swtimer_remove (&budget_timer);
+      chx_swtimer_link (&budget_timer, now + b->remain, 0, now);
     }
+}
+
+
+/**
+ * chopstx_budget_start - Start CPU budget of a thread
+ * @budget: CPU budget
+ * @thd: Thread
+ * @budget_usec: Budget in micro seconds
+ * @period_usec: Period of replenishment in micro seconds
+ * @prio_bg: Background priority
+ *
+ * Let @thd run for @budget_usec in every @period_usec, at its
+ * priority.  When the budget is exhausted, it runs at @prio_bg until
+ * next replenishment, so that it can't starve threads of lower
+ * priority.  Priority inherited by a mutex is kept while demoted.  A
+ * thread has one budget; when @thd already has one, it is replaced.
+ * The budget is stopped when @thd exits.
+ */
+void
+chopstx_budget_start (chopstx_budget_t *budget, chopstx_t thd,
+		      uint32_t budget_usec, uint32_t period_usec,
+		      chopstx_prio_t prio_bg)
+{
+  struct chx_thread *tp = (struct chx_thread *)thd;
+  uint64_t now;
+
+  if (tp->budget)
+    chopstx_budget_stop (tp->budget);
+
+  chopstx_timer_init (&budget->timer, chx_budget_replenish, budget, NULL);
+  budget->thd = tp;
+  budget->budget = budget->remain = usec_to_ticks (budget_usec);
+  budget->exhausted = 0;
+  budget->prio_bg = prio_bg;
+  budget->prio_orig = 0;
+  budget->demoted = 0;
 
   chx_cpu_sched_lock ();
-  chx_spin_lock (&px->lock);
-  if (counter)
+  now = chx_clock_ticks ();
+  tp->budget = budget;
+  chx_swtimer_link (&budget->timer, now + usec_to_ticks (period_usec),
+		    usec_to_ticks (period_usec), now);
+  if (tp == running)
     {
-      chx_spin_unlock (&px->lock);
-      chx_cpu_sched_unlock ();
+      budget_cur = budget;
+      budget_start = now;
+      chx_swtimer_link (&budget_timer, now + budget->remain, 0, now);
     }
-  else if (usec_p == NULL)
-    {
-      if (running->flag_sched_rr)
-	chx_timer_dequeue (running);
+  chx_cpu_sched_unlock ();
+}
 
-      running->state = THREAD_WAIT_POLL;
-      chx_spin_unlock (&px->lock);
-      r = chx_sched (CHX_SLEEP);
-    }
-  else
+
+/*
+ * Detach BUDGET from its thread, restoring the priority if demoted.
+ * Returns the priority for preemption, or 0.  Called with schedule
+ * lock held.
+ */
+static uint16_t
+chx_budget_detach (struct chx_budget *budget)
+{
+  uint16_t prio = 0;
+
+  if (budget->thd)
     {
-      chx_spin_unlock (&px->lock);
-      chx_cpu_sched_unlock ();
-      do
+      chx_swtimer_remove (&budget->timer);
+      if (budget == budget_cur)
 	{
-	  chopstx_testcancel ();
-	  chx_cpu_sched_lock ();
-	  if (counter)
-	    {
-	      chx_cpu_sched_unlock ();
-	      break;
-	    }
-	  r = chx_snooze (THREAD_WAIT_POLL, usec_p);
+	  chx_swtimer_remove (&budget_timer);
+	  budget_cur = NULL;
 	}
-      while (r == 0);
+      budget->thd->budget = NULL;
+      if (budget->demoted)
+	prio = chx_budget_restore (budget);
+      budget->thd = NULL;
     }
 
-  for (i = 0; i < n; i++)
-    {
-      pd = pd_array[i];
-      chx_cpu_sched_lock ();
-      chx_spin_lock (&px[i].lock);
-      if (pd->type == CHOPSTX_POLL_COND)
-	{
-	  struct chx_poll_cond *pc = (struct chx_poll_cond *)pd;
+  return prio;
+}
 
-	  if (pc->ready == 0)
-	    {
-	      chx_spin_lock (&pc->cond->lock);
-	      ll_dequeue ((struct chx_pq *)&px[i]);
-	      chx_spin_unlock (&pc->cond->lock);
-	    }
-	}
-      else if (pd->type == CHOPSTX_POLL_INTR)
-	{
-	  struct chx_intr *intr = (struct chx_intr *)pd;
 
-	  if (intr->ready)
-	    chx_clr_intr (intr->irq_num);
-	  else
-	    {
-	      chx_spin_lock (&q_intr.lock);
-	      ll_dequeue ((struct chx_pq *)&px[i]);
-	      chx_spin_unlock (&q_intr.lock);
-	      chx_disable_intr (intr->irq_num);
-	    }
-	}
-      else
-	{
-	  struct chx_poll_join *pj = (struct chx_poll_join *)pd;
+/**
+ * chopstx_budget_stop - Stop CPU budget of a thread
+ * @budget: CPU budget
+ *
+ * Stop @budget.  When its thread is demoted, its priority is
+ * restored.
+ */
+void
+chopstx_budget_stop (chopstx_budget_t *budget)
+{
+  uint16_t prio;
 
-	  if (pj->ready == 0)
-	    {
-	      chx_spin_lock (&q_join.lock);
-	      ll_dequeue ((struct chx_pq *)&px[i]);
-	      chx_spin_unlock (&q_join.lock);
-	    }
-	}
-      chx_spin_unlock (&px[i].lock);
-      chx_cpu_sched_unlock ();
-    }
+  chx_cpu_sched_lock ();
+  prio = chx_budget_detach (budget);
+  if (prio > running->prio)
+    chx_sched (CHX_YIELD);
+  else
+    chx_cpu_sched_unlock ();
+}
 
-  if (r < 0)
-    chopstx_exit (CHOPSTX_CANCELED);
 
-  return counter;
+/**
+ * chopstx_budget_exhausted - Get the number of exhaustion
+ * @budget: CPU budget
+ *
+ * Returns the number of times @budget was exhausted, since
+ * chopstx_budget_start.
+ */
+uint32_t
+chopstx_budget_exhausted (chopstx_budget_t *budget)
+{
+  return budget->exhausted;
 }
+#endif
 
 
 /**
@@ -1469,3 +4840,117 @@ chopstx_setpriority (chopstx_prio_t prio_new)
 
   return prio_orig;
 }
+
+
+#if defined(CHX_THREAD_STATS)
+/**
+ * chopstx_thread_stats - Get statistics of threads
+ * @st: Array to store statistics
+ * @n: Number of elements of @st
+ *
+ * Store a snapshot of the statistics of threads to @st, up to @n
+ * threads.  Returns the number of threads stored.
+ */
+int
+chopstx_thread_stats (struct chopstx_thread_stats *st, int n)
+{
+  struct chx_thread *tp;
+  uint64_t now;
+  int i = 0;
+
+  chx_cpu_sched_lock ();
+  now = chx_clock_ticks ();
+  for (tp = thread_list; tp && i < n; tp = tp->list_next, i++)
+    {
+      uint64_t ticks = tp->run_ticks;
+
+      if (tp == running)
+	ticks += now - stats_switch_ticks;
+      st[i].thd = (chopstx_t)tp;
+      st[i].run_usec = ticks / MHZ;
+      st[i].nvcsw = tp->nvcsw;
+      st[i].nivcsw = tp->nivcsw;
+      st[i].nwakeup = tp->nwakeup;
+    }
+  chx_cpu_sched_unlock ();
+  return i;
+}
+#endif
+
+
+#if defined(CHX_STACK_HIGHWATER)
+/**
+ * chopstx_stack_highwater - Get the maximum usage of stack
+ * @thd: Thread
+ *
+ * Returns the maximum bytes used in the stack of @thd until now.  On
+ * Cortex-M, it includes the thread structure at the top of stack.
+ * It is zero for the main thread, whose stack is not examined.
+ */
+size_t
+chopstx_stack_highwater (chopstx_t thd)
+{
+  return chx_stack_used ((struct chx_thread *)thd);
+}
+#endif
+
+
+#if defined(CHX_MUTEX_PROFILE)
+/**
+ * chopstx_mutex_profile - Get contention profile of mutexes
+ * @st: Array to store the profile
+ * @n: Number of elements of @st
+ *
+ * Store a snapshot of the contention profile of mutexes to @st, up to
+ * @n mutexes.  Returns the number of mutexes stored.
+ */
+int
+chopstx_mutex_profile (struct chopstx_mutex_stats *st, int n)
+{
+  chopstx_mutex_t *m;
+  int i = 0;
+
+  chx_cpu_sched_lock ();
+  for (m = mutex_prof_list; m && i < n; m = m->prof_next, i++)
+    {
+      st[i].mutex = m;
+      st[i].acquired = m->acquired;
+      st[i].contended = m->contended;
+      st[i].boosted = m->boosted;
+      st[i].wait_total_usec = m->wait_total / MHZ;
+      st[i].wait_max_usec = m->wait_max / MHZ;
+    }
+  chx_cpu_sched_unlock ();
+  return i;
+}
+#endif
+
+
+#if defined(CHX_TRACE)
+/**
+ * chopstx_trace_enable - Enable or disable the scheduler trace
+ * @enable: 1 to enable, 0 to disable
+ *
+ * Disable the trace before dumping the buffer, so that it will not
+ * be overwritten while dumping.
+ */
+void
+chopstx_trace_enable (int enable)
+{
+  chx_cpu_sched_lock ();
+  trace.enabled = enable;
+  chx_cpu_sched_unlock ();
+}
+
+/**
+ * chopstx_trace_get - Get the scheduler trace buffer
+ *
+ * Returns the trace buffer.  Its content (sizeof (struct
+ * chopstx_trace) bytes) can be decoded by tool/chopstx-trace.py.
+ */
+const struct chopstx_trace *
+chopstx_trace_get (void)
+{
+  return &trace;
+}
+#endif
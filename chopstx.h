@@ -44,11 +44,33 @@ chopstx_create (uint32_t flags_and_prio,
 #define CHOPSTX_PRIO_BITS 8
 #define CHOPSTX_DETACHED 0x10000
 #define CHOPSTX_SCHED_RR 0x20000
+#define CHOPSTX_SCHED_EDF 0x40000
+/* Time slice of CHOPSTX_SCHED_RR in msec (1-255), 0 for default.
+ * Ignored without CHX_RR_QUANTUM.  */
+#define CHOPSTX_QUANTUM_SHIFT 24
+#define CHOPSTX_QUANTUM(msec) ((uint32_t)(msec) << CHOPSTX_QUANTUM_SHIFT)
 
 #define CHOPSTX_PRIO_INHIBIT_PREEMPTION 248
 
 void chopstx_usec_wait (uint32_t usec);
 
+uint64_t chopstx_clock_gettime (void);
+void chopstx_sleep_until (uint64_t usec);
+
+/* EDF is for periodic release.  */
+#if defined(CHX_SCHED_EDF) && !defined(CHX_PERIODIC)
+#define CHX_PERIODIC 1
+#endif
+
+#if defined(CHX_PERIODIC)
+void chopstx_periodic_start (uint32_t period_usec);
+int chopstx_periodic_wait (void);
+uint32_t chopstx_periodic_missed (void);
+#endif
+#if defined(CHX_SCHED_EDF)
+void chopstx_periodic_deadline (uint32_t deadline_usec);
+#endif
+
 struct chx_spinlock {
   /* nothing for uniprocessor.  */
 };
@@ -58,6 +80,14 @@ typedef struct chx_mtx {
   struct chx_spinlock lock;
   struct chx_thread *owner;
   struct chx_mtx *list;
+#if defined(CHX_MUTEX_PROFILE)
+  struct chx_mtx *prof_next;	/* List of all mutexes.  */
+  uint32_t acquired;
+  uint32_t contended;
+  uint32_t boosted;
+  uint64_t wait_total;		/* In ticks.  */
+  uint64_t wait_max;		/* In ticks.  */
+#endif
 } chopstx_mutex_t;
 
 /* NOTE: This signature is different to PTHREAD's one.  */
@@ -67,6 +97,19 @@ void chopstx_mutex_lock (chopstx_mutex_t *mutex);
 
 void chopstx_mutex_unlock (chopstx_mutex_t *mutex);
 
+#if defined(CHX_MUTEX_PROFILE)
+struct chopstx_mutex_stats {
+  chopstx_mutex_t *mutex;
+  uint32_t acquired;	/* Number of acquisitions.  */
+  uint32_t contended;	/* Number of acquisitions which waited.  */
+  uint32_t boosted;	/* Number of priority inheritance boosts.  */
+  uint64_t wait_total_usec;
+  uint64_t wait_max_usec;
+};
+
+int chopstx_mutex_profile (struct chopstx_mutex_stats *st, int n);
+#endif
+
 typedef struct chx_cond {
   struct chx_qh q;
   struct chx_spinlock lock;
@@ -79,6 +122,20 @@ void chopstx_cond_wait (chopstx_cond_t *cond, chopstx_mutex_t *mutex);
 void chopstx_cond_signal (chopstx_cond_t *cond);
 void chopstx_cond_broadcast (chopstx_cond_t *cond);
 
+typedef struct chx_rwlock {
+  struct chx_mtx mtx;		/* Exclusive owner, and waiters.  */
+  uint16_t readers;		/* Number of shared owners.  */
+  uint8_t writers;		/* Number of waiting writers.  */
+  uint8_t flags;
+} chopstx_rwlock_t;
+
+#define CHOPSTX_RWLOCK_PREFER_WRITER 1
+
+void chopstx_rwlock_init (chopstx_rwlock_t *rw, int flags);
+void chopstx_rwlock_rdlock (chopstx_rwlock_t *rw);
+void chopstx_rwlock_wrlock (chopstx_rwlock_t *rw);
+void chopstx_rwlock_unlock (chopstx_rwlock_t *rw);
+
 /*
  * Library provides default implementation as weak reference.
  * User can replace it.
@@ -115,10 +172,76 @@ void chopstx_cleanup_pop (int execute);
 
 chopstx_prio_t chopstx_setpriority (chopstx_prio_t);
 
+#if defined(CHX_THREAD_STATS)
+struct chopstx_thread_stats {
+  chopstx_t thd;
+  uint32_t nvcsw;	/* Number of context switches by sleep.  */
+  uint32_t nivcsw;	/* Number of context switches by preemption.  */
+  uint32_t nwakeup;	/* Number of wakeups.  */
+  uint64_t run_usec;	/* Run time in micro seconds.  */
+};
+
+int chopstx_thread_stats (struct chopstx_thread_stats *st, int n);
+#endif
+
+#if defined(CHX_STACK_HIGHWATER)
+size_t chopstx_stack_highwater (chopstx_t thd);
+#endif
+
+#if defined(CHX_TRACE)
+/* Events of scheduler trace.  */
+enum {
+  CHOPSTX_TRACE_SWITCH = 1,	/* Switch to THD (0 for idle).  */
+  CHOPSTX_TRACE_WAKEUP,		/* THD is woken up, ARG is its state.  */
+  CHOPSTX_TRACE_TIMER,		/* Timer expired.  */
+  CHOPSTX_TRACE_INTR,		/* Interrupt, ARG is IRQ number.  */
+  CHOPSTX_TRACE_MUTEX_WAIT,	/* THD waits for mutex OBJ.  */
+  CHOPSTX_TRACE_MUTEX_LOCK,	/* THD gets mutex OBJ by slow path.  */
+  CHOPSTX_TRACE_COND_WAIT,	/* THD waits on condition OBJ.  */
+  CHOPSTX_TRACE_COND_SIGNAL,	/* THD signals condition OBJ.  */
+};
+
+struct chopstx_trace_record {
+  uint32_t time;		/* Lower 32-bit of ticks.  */
+  uint8_t event;
+  uint8_t prio;
+  uint16_t arg;
+  uintptr_t thd;
+  uintptr_t obj;
+};
+
+#ifndef CHX_TRACE_SIZE
+#define CHX_TRACE_SIZE 256	/* Must be power of 2.  */
+#endif
+
+#define CHOPSTX_TRACE_MAGIC 0x54584843 /* "CHXT" in little endian.  */
+
+/*
+ * Trace buffer.  It is dumped as is, with the header.  Records are
+ * in the ring buffer, and the next one will be written at
+ * INDEX % SIZE.
+ */
+struct chopstx_trace {
+  uint32_t magic;
+  uint16_t record_size;
+  uint16_t size;		/* Number of records.  */
+  uint32_t mhz;			/* Ticks per micro second.  */
+  uint32_t index;		/* Number of records written.  */
+  uint32_t enabled;
+  uint32_t reserved;
+  struct chopstx_trace_record rec[CHX_TRACE_SIZE];
+};
+
+void chopstx_trace_enable (int enable);
+const struct chopstx_trace *chopstx_trace_get (void);
+#endif
+
 enum {
   CHOPSTX_POLL_COND = 0,
   CHOPSTX_POLL_INTR,
   CHOPSTX_POLL_JOIN,
+  CHOPSTX_POLL_MQUEUE,
+  CHOPSTX_POLL_SEM,
 };
 
 struct chx_poll_head {
@@ -158,6 +281,257 @@ void chopstx_claim_irq (chopstx_intr_t *intr, uint8_t irq_num);
 void chopstx_intr_wait (chopstx_intr_t *intr); /* DEPRECATED */
 
 
+/*
+ * Message queue of fixed size messages.  The ring buffer is supplied
+ * by user, with the size of CHOPSTX_MQUEUE_BUF_WORDS (SIZE, N) words
+ * for N messages of SIZE bytes.
+ */
+typedef struct chx_mqueue {
+  struct chx_cond recv;		/* Threads waiting for a message.  */
+  struct chx_cond send;		/* Threads waiting for a room.  */
+  uint32_t *buf;
+  uint16_t size;		/* Size of a message in bytes.  */
+  uint16_t words;		/* Size of a message in words.  */
+  uint16_t capacity;		/* Number of messages in BUF.  */
+  uint16_t count;
+  uint16_t head;
+} chopstx_mqueue_t;
+
+#define CHOPSTX_MQUEUE_BUF_WORDS(size,n) ((((size) + 3) / 4) * (n))
+
+/*
+ * Define a message queue NAME for N messages of TYPE, with its ring
+ * buffer, and typed functions NAME_init, NAME_send, NAME_receive,
+ * NAME_send_timeout, NAME_receive_timeout, NAME_try_send,
+ * NAME_try_receive, and NAME_send_from_isr.  The capacity is fixed at
+ * compile time.  The functions are thin wrappers of chopstx_mqueue_*.
+ */
+#define CHOPSTX_MQUEUE_DEFINE(name,type,n)				\
+  static uint32_t name##_buf[CHOPSTX_MQUEUE_BUF_WORDS (sizeof (type), n)]; \
+  static chopstx_mqueue_t name;						\
+  static inline void name##_init (void)					\
+  { chopstx_mqueue_init (&name, name##_buf, sizeof (type), n); }	\
+  static inline void name##_send (const type *msg)			\
+  { chopstx_mqueue_send (&name, msg); }					\
+  static inline void name##_receive (type *msg)				\
+  { chopstx_mqueue_receive (&name, msg); }				\
+  static inline int name##_send_timeout (const type *msg, uint32_t usec) \
+  { return chopstx_mqueue_send_timeout (&name, msg, usec); }		\
+  static inline int name##_receive_timeout (type *msg, uint32_t usec)	\
+  { return chopstx_mqueue_receive_timeout (&name, msg, usec); }	\
+  static inline int name##_try_send (const type *msg)			\
+  { return chopstx_mqueue_try_send (&name, msg); }			\
+  static inline int name##_try_receive (type *msg)			\
+  { return chopstx_mqueue_try_receive (&name, msg); }			\
+  static inline int name##_send_from_isr (const type *msg)		\
+  { return chopstx_mqueue_send_from_isr (&name, msg); }
+
+void chopstx_mqueue_init (chopstx_mqueue_t *mq, uint32_t *buf,
+			  uint16_t size, uint16_t n);
+void chopstx_mqueue_send (chopstx_mqueue_t *mq, const void *msg);
+void chopstx_mqueue_receive (chopstx_mqueue_t *mq, void *msg);
+int chopstx_mqueue_send_timeout (chopstx_mqueue_t *mq, const void *msg,
+				 uint32_t usec);
+int chopstx_mqueue_receive_timeout (chopstx_mqueue_t *mq, void *msg,
+				    uint32_t usec);
+int chopstx_mqueue_try_send (chopstx_mqueue_t *mq, const void *msg);
+int chopstx_mqueue_try_receive (chopstx_mqueue_t *mq, void *msg);
+int chopstx_mqueue_send_from_isr (chopstx_mqueue_t *mq, const void *msg);
+
+struct chx_poll_mqueue {
+  uint16_t type;
+  uint16_t ready;
+  /**/
+  chopstx_mqueue_t *mq;
+  int send;			/* Wait for a room, instead of a message.  */
+};
+typedef struct chx_poll_mqueue chopstx_poll_mqueue_t;
+
+void chopstx_mqueue_prepare_poll (chopstx_mqueue_t *mq,
+				  chopstx_poll_mqueue_t *p, int send);
+
+
+typedef struct chx_sem {
+  struct chx_cond q;
+  uint32_t value;		/* Count << 1, and a flag of waiter.  */
+} chopstx_sem_t;
+
+void chopstx_sem_init (chopstx_sem_t *sem, uint32_t value);
+void chopstx_sem_post (chopstx_sem_t *sem);
+void chopstx_sem_post_from_isr (chopstx_sem_t *sem);
+void chopstx_sem_wait (chopstx_sem_t *sem);
+int chopstx_sem_timedwait (chopstx_sem_t *sem, uint32_t usec);
+int chopstx_sem_trywait (chopstx_sem_t *sem);
+
+struct chx_poll_sem {
+  uint16_t type;
+  uint16_t ready;
+  /**/
+  chopstx_sem_t *sem;
+};
+typedef struct chx_poll_sem chopstx_poll_sem_t;
+
+void chopstx_sem_prepare_poll (chopstx_sem_t *sem, chopstx_poll_sem_t *p);
+
+
 int chopstx_poll (uint32_t *usec_p, int n, struct chx_poll_head *pd_array[]);
+int chopstx_poll_until (uint64_t usec, int n,
+			struct chx_poll_head *pd_array[]);
 
-#define CHOPSTX_THREAD_SIZE 64
+/*
+ * Poll set: poll descriptors registered to a poll set stay hooked
+ * across waits.
+ */
+struct chx_pollset_entry {
+  uintptr_t px[8];		/* Internal use.  */
+  struct chx_pollset *set;
+  struct chx_pollset_entry *next;
+  struct chx_pollset_entry *link; /* Next of all entries in the set.  */
+  struct chx_poll_head *pd;
+  uint32_t armed;
+};
+typedef struct chx_pollset_entry chopstx_pollset_entry_t;
+
+typedef struct chx_pollset {
+  struct chx_pollset_entry *ready;
+  struct chx_pollset_entry **ready_tail;
+  struct chx_pollset_entry *rearm;
+  struct chx_pollset_entry *list;
+  struct chx_thread *master;
+  uint32_t counter;
+  uint32_t prio;		/* Priority of the proxies.  */
+} chopstx_pollset_t;
+
+void chopstx_pollset_init (chopstx_pollset_t *ps);
+void chopstx_pollset_add (chopstx_pollset_t *ps, chopstx_pollset_entry_t *e,
+			  struct chx_poll_head *pd);
+void chopstx_pollset_remove (chopstx_pollset_t *ps,
+			     chopstx_pollset_entry_t *e);
+void chopstx_pollset_destroy (chopstx_pollset_t *ps);
+int chopstx_pollset_wait (chopstx_pollset_t *ps, uint32_t *usec_p,
+			  struct chx_poll_head *pd_array[], int n);
+
+/*
+ * Work queue: work items are run by worker threads of the queue.
+ */
+typedef struct chx_work {
+  struct chx_work *next;
+  struct chx_work **pprev;	/* Link to this, for cancel.  */
+  void (*func) (void *);
+  void *arg;
+  uint64_t deadline;		/* In ticks, for delayed work.  */
+  uint32_t state;
+} chopstx_work_t;
+
+typedef struct chx_workqueue {
+  struct chx_cond idle;		/* Idle workers.  */
+  struct chx_work *head, *tail;	/* Pending work.  */
+  struct chx_work *delayed;	/* Delayed work, sorted by deadline.  */
+  struct chx_thread *timer_worker; /* Worker sleeping for delayed work.  */
+} chopstx_workqueue_t;
+
+void chopstx_work_init (chopstx_work_t *work, void (*func) (void *),
+			void *arg);
+void chopstx_workqueue_init (chopstx_workqueue_t *wq);
+chopstx_t chopstx_workqueue_add_worker (chopstx_workqueue_t *wq,
+					chopstx_prio_t prio,
+					uintptr_t stack_addr,
+					size_t stack_size);
+int chopstx_work_post (chopstx_workqueue_t *wq, chopstx_work_t *work);
+int chopstx_work_post_from_isr (chopstx_workqueue_t *wq,
+				chopstx_work_t *work);
+int chopstx_work_post_delayed (chopstx_workqueue_t *wq, chopstx_work_t *work,
+			       uint32_t usec);
+int chopstx_work_cancel (chopstx_workqueue_t *wq, chopstx_work_t *work);
+
+/*
+ * Software timer: it's on the timer queue, like a sleeping thread.
+ */
+typedef struct chx_timer {
+  uintptr_t pq[5];		/* Internal use.  */
+  struct chx_timer *next;	/* Internal use.  */
+  uint64_t deadline;		/* In ticks.  */
+  uint64_t period;		/* In ticks, or 0 for one-shot.  */
+  chopstx_workqueue_t *wq;
+  chopstx_work_t work;
+} chopstx_timer_t;
+
+void chopstx_timer_init (chopstx_timer_t *timer, void (*func) (void *),
+			 void *arg, chopstx_workqueue_t *wq);
+void chopstx_timer_start (chopstx_timer_t *timer, uint32_t usec,
+			  uint32_t period_usec);
+int chopstx_timer_stop (chopstx_timer_t *timer);
+
+#if defined(CHX_CPU_BUDGET)
+/*
+ * CPU budget: a thread may run for BUDGET ticks in every period.
+ * When it's exhausted, the thread runs at background priority until
+ * the next replenishment.
+ */
+typedef struct chx_budget {
+  chopstx_timer_t timer;	/* Internal use: replenishment.  */
+  struct chx_thread *thd;	/* Internal use.  */
+  uint64_t budget;		/* In ticks.  */
+  uint64_t remain;		/* In ticks.  */
+  uint32_t exhausted;		/* Number of times exhausted.  */
+  uint8_t prio_bg;		/* Background priority.  */
+  uint8_t prio_orig;		/* Internal use: saved priority.  */
+  uint8_t demoted;		/* Internal use.  */
+} chopstx_budget_t;
+
+void chopstx_budget_start (chopstx_budget_t *budget, chopstx_t thd,
+			   uint32_t budget_usec, uint32_t period_usec,
+			   chopstx_prio_t prio_bg);
+void chopstx_budget_stop (chopstx_budget_t *budget);
+uint32_t chopstx_budget_exhausted (chopstx_budget_t *budget);
+#endif
+
+/*
+ * Size of struct chx_thread on Cortex-M: the fields always there, and
+ * the fields of the options, rounded up to 8.  It should be a
+ * constant expression, which can be used by assembler in entry.c.
+ */
+#define CHX_THREAD_SIZE_BASE 72
+#if defined(CHX_PERIODIC)
+#define CHX_THREAD_SIZE_PERIODIC 16
+#else
+#define CHX_THREAD_SIZE_PERIODIC 0
+#endif
+#if defined(CHX_SCHED_EDF)
+#define CHX_THREAD_SIZE_EDF 12
+#else
+#define CHX_THREAD_SIZE_EDF 0
+#endif
+#if defined(CHX_CPU_BUDGET)
+#define CHX_THREAD_SIZE_BUDGET 4
+#else
+#define CHX_THREAD_SIZE_BUDGET 0
+#endif
+#if defined(CHX_RR_QUANTUM)
+#define CHX_THREAD_SIZE_RR 8
+#else
+#define CHX_THREAD_SIZE_RR 0
+#endif
+#if defined(CHX_THREAD_STATS) || defined(CHX_STACK_HIGHWATER)
+#define CHX_THREAD_SIZE_LIST 4
+#else
+#define CHX_THREAD_SIZE_LIST 0
+#endif
+#if defined(CHX_THREAD_STATS)
+#define CHX_THREAD_SIZE_STATS 20
+#else
+#define CHX_THREAD_SIZE_STATS 0
+#endif
+#if defined(CHX_STACK_HIGHWATER)
+#define CHX_THREAD_SIZE_HIGHWATER 8
+#else
+#define CHX_THREAD_SIZE_HIGHWATER 0
+#endif
+#define CHOPSTX_THREAD_SIZE ((CHX_THREAD_SIZE_BASE			\
+			      + CHX_THREAD_SIZE_PERIODIC		\
+			      + CHX_THREAD_SIZE_EDF			\
+			      + CHX_THREAD_SIZE_BUDGET			\
+			      + CHX_THREAD_SIZE_RR			\
+			      + CHX_THREAD_SIZE_LIST			\
+			      + CHX_THREAD_SIZE_STATS			\
+			      + CHX_THREAD_SIZE_HIGHWATER + 7) & ~7)
@@ -31,13 +31,184 @@
 #include <chopstx.h>
 #include <eventflag.h>
 
+/*
+ * FLAGS is updated by atomic operations, so that eventflag_signal can
+ * be done without lock.  A thread waiting registers the bits in MASK,
+ * and it is woken up by SEM only when its condition becomes true.
+ * When polled, SEM has a count while FLAGS is not zero.
+ *
+ * Poll by chopstx_poll_cond_t (deprecated eventflag_prepare_poll) uses
+ * MUTEX and COND instead, and it's woken up by eventflag_signal only.
+ *
+ * An eventflag is waited for by a single thread.
+ */
+
+/* Bits of ->POLL.  */
+#define EVENTFLAG_POLL_SEM  1
+#define EVENTFLAG_POLL_COND 2
+
+/* Internal mode: get the lowest bit only.  */
+#define EVENTFLAG_WAIT_ONE 2
+
+#if defined(__ARM_ARCH_6M__)
+/* No LDREX/STREX; disable interrupts instead.  */
+static eventmask_t
+ev_fetch_or (eventmask_t *p, eventmask_t m)
+{
+  uint32_t primask;
+  eventmask_t v;
+
+  asm volatile ("mrs	%0, PRIMASK\n\t"
+		"cpsid	i" : "=r" (primask) : /* no input */ : "memory");
+  v = *p;
+  *p = v | m;
+  asm volatile ("msr	PRIMASK, %0" : : "r" (primask) : "memory");
+  return v;
+}
+
+static int
+ev_cas (eventmask_t *p, eventmask_t *v_p, eventmask_t v_new)
+{
+  uint32_t primask;
+  int r;
+
+  asm volatile ("mrs	%0, PRIMASK\n\t"
+		"cpsid	i" : "=r" (primask) : /* no input */ : "memory");
+  r = (*p == *v_p);
+  if (r)
+    *p = v_new;
+  else
+    *v_p = *p;
+  asm volatile ("msr	PRIMASK, %0" : : "r" (primask) : "memory");
+  return r;
+}
+#else
+#define ev_fetch_or(p,m) __atomic_fetch_or (p, m, __ATOMIC_SEQ_CST)
+#define ev_cas(p,v_p,v_new) \
+  __atomic_compare_exchange_n (p, v_p, v_new, 1, \
+			       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+#endif
+
 
 void
 eventflag_init (struct eventflag *ev)
 {
   ev->flags = 0;
-  chopstx_cond_init (&ev->cond);
+  ev->mask = 0;
+  ev->wait_all = 0;
+  ev->poll = 0;
+  chopstx_sem_init (&ev->sem, 0);
   chopstx_mutex_init (&ev->mutex);
+  chopstx_cond_init (&ev->cond);
+}
+
+
+/*
+ * Take the bits of MASK from EV by MODE.  Returns the bits, or 0 when
+ * the condition is not met.
+ */
+static eventmask_t
+eventflag_take (struct eventflag *ev, eventmask_t mask, int mode)
+{
+  eventmask_t v = __atomic_load_n (&ev->flags, __ATOMIC_RELAXED);
+  eventmask_t m;
+
+  do
+    {
+      m = v & mask;
+      if (mode == EVENTFLAG_WAIT_ALL && m != mask)
+	return 0;
+      else if (mode == EVENTFLAG_WAIT_ONE)
+	m &= -m;
+
+      if (m == 0)
+	return 0;
+    }
+  while (!ev_cas (&ev->flags, &v, v & ~m));
+
+  if ((ev->poll & EVENTFLAG_POLL_SEM) && (v & ~m))
+    /* Some remain, keep it ready for poll.  */
+    chopstx_sem_post (&ev->sem);
+
+  return m;
+}
+
+
+static eventmask_t
+eventflag_wait_1 (struct eventflag *ev, eventmask_t mask, int mode,
+		  uint32_t *usec_p)
+{
+  chopstx_poll_sem_t poll_desc;
+  struct chx_poll_head *pd_array[1] = { (struct chx_poll_head *)&poll_desc };
+  eventmask_t m;
+
+  for (;;)
+    {
+      /* Discard old wakeups.  */
+      while (chopstx_sem_trywait (&ev->sem))
+	;
+
+      m = eventflag_take (ev, mask, mode);
+      if (m || (usec_p && *usec_p == 0))
+	return m;
+
+      /* Register, and check again not to miss a signal.  */
+      ev->wait_all = (mode == EVENTFLAG_WAIT_ALL);
+      __atomic_store_n (&ev->mask, mask, __ATOMIC_SEQ_CST);
+      m = eventflag_take (ev, mask, mode);
+      if (m == 0)
+	{
+	  if (usec_p == NULL)
+	    chopstx_sem_wait (&ev->sem);
+	  else
+	    {
+	      chopstx_sem_prepare_poll (&ev->sem, &poll_desc);
+	      chopstx_poll (usec_p, 1, pd_array);
+	    }
+	}
+      __atomic_store_n (&ev->mask, 0, __ATOMIC_RELAXED);
+
+      if (m)
+	return m;
+    }
+}
+
+
+/*
+ * Set the bits M to EV.  Returns 1 when the thread waiting (or
+ * polling) should be woken up.
+ */
+static int
+eventflag_set (struct eventflag *ev, eventmask_t m)
+{
+  eventmask_t v_old = ev_fetch_or (&ev->flags, m);
+  eventmask_t v_new = v_old | m;
+  eventmask_t mask = __atomic_load_n (&ev->mask, __ATOMIC_SEQ_CST);
+
+  if (mask)
+    {
+      if (ev->wait_all)
+	{
+	  if ((v_new & mask) == mask && (v_old & mask) != mask)
+	    return 1;
+	}
+      else if ((v_new & mask) && !(v_old & mask))
+	return 1;
+    }
+
+  return (ev->poll & EVENTFLAG_POLL_SEM) && v_old == 0;
+}
+
+
+void
+eventflag_prepare_poll_sem (struct eventflag *ev,
+			    chopstx_poll_sem_t *poll_desc)
+{
+  ev->poll |= EVENTFLAG_POLL_SEM;
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&ev->flags, __ATOMIC_RELAXED))
+    chopstx_sem_post (&ev->sem);
+  chopstx_sem_prepare_poll (&ev->sem, poll_desc);
 }
 
 
@@ -46,13 +217,19 @@ eventflag_check (void *arg)
 {
   struct eventflag *ev = arg;
 
-  return ev->flags != 0;
+  return __atomic_load_n (&ev->flags, __ATOMIC_SEQ_CST) != 0;
 }
 
 
+/*
+ * Deprecated, as eventflag_signal_from_isr can't wake up the poll.
+ * Use eventflag_prepare_poll_sem instead.
+ */
 void
 eventflag_prepare_poll (struct eventflag *ev, chopstx_poll_cond_t *poll_desc)
-{ 
+{
+  ev->poll |= EVENTFLAG_POLL_COND;
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
   poll_desc->type = CHOPSTX_POLL_COND;
   poll_desc->ready = 0;
   poll_desc->cond = &ev->cond;
@@ -65,65 +242,63 @@ eventflag_prepare_poll (struct eventflag *ev, chopstx_poll_cond_t *poll_desc)
 eventmask_t
 eventflag_get (struct eventflag *ev)
 {
-  int n;
-  eventmask_t m;
-
-  chopstx_mutex_lock (&ev->mutex);
-  n = __builtin_ffs (ev->flags);
-  if (n)
-    {
-      m = (1 << (n - 1));
-      ev->flags &= ~m;
-    }
-  else
-    m = 0;
-  chopstx_mutex_unlock (&ev->mutex);
-
-  return m;
+  while (chopstx_sem_trywait (&ev->sem))
+    ;
+  return eventflag_take (ev, ~0, EVENTFLAG_WAIT_ONE);
 }
 
 
 eventmask_t
 eventflag_wait (struct eventflag *ev)
 {
-  int n;
-  eventmask_t m;
-
-  chopstx_mutex_lock (&ev->mutex);
-  if (!ev->flags)
-    chopstx_cond_wait (&ev->cond, &ev->mutex);
-
-  n = __builtin_ffs (ev->flags);
-  if (n) /* Always n > 0 when waked up, but make sure no bad things.  */
-    {
-      m = (1 << (n - 1));
-      ev->flags &= ~m;
-    }
-  else
-    m = 0;
-  chopstx_mutex_unlock (&ev->mutex);
-
-  return m;
+  return eventflag_wait_1 (ev, ~0, EVENTFLAG_WAIT_ONE, NULL);
 }
 
 
 eventmask_t
 eventflag_wait_timeout (struct eventflag *ev, uint32_t usec)
 {
-  chopstx_poll_cond_t poll_desc;
-  struct chx_poll_head *pd_array[1] = { (struct chx_poll_head *)&poll_desc };
+  return eventflag_wait_1 (ev, ~0, EVENTFLAG_WAIT_ONE, &usec);
+}
 
-  eventflag_prepare_poll (ev, &poll_desc);
-  chopstx_poll (&usec, 1, pd_array);
-  return eventflag_get (ev);
+
+/*
+ * Wait for bits of MASK, until any of them (MODE is
+ * EVENTFLAG_WAIT_ANY) or all of them (EVENTFLAG_WAIT_ALL) are set,
+ * for *USEC_P micro seconds (forever if USEC_P is NULL).  Returns all
+ * the bits which are taken, or 0 on timeout.  Remaining usec is
+ * stored into *USEC_P.
+ */
+eventmask_t
+eventflag_wait_mask (struct eventflag *ev, eventmask_t mask, int mode,
+		     uint32_t *usec_p)
+{
+  return eventflag_wait_1 (ev, mask, mode, usec_p);
 }
 
 
 void
 eventflag_signal (struct eventflag *ev, eventmask_t m)
 {
-  chopstx_mutex_lock (&ev->mutex);
-  ev->flags |= m;
-  chopstx_cond_signal (&ev->cond);
-  chopstx_mutex_unlock (&ev->mutex);
+  if (eventflag_set (ev, m))
+    chopstx_sem_post (&ev->sem);
+
+  if ((__atomic_load_n (&ev->poll, __ATOMIC_SEQ_CST) & EVENTFLAG_POLL_COND))
+    {
+      chopstx_mutex_lock (&ev->mutex);
+      chopstx_cond_signal (&ev->cond);
+      chopstx_mutex_unlock (&ev->mutex);
+    }
+}
+
+
+/*
+ * Same as eventflag_signal, but called from an interrupt handler.  It
+ * doesn't wake up the poll prepared by eventflag_prepare_poll.
+ */
+void
+eventflag_signal_from_isr (struct eventflag *ev, eventmask_t m)
+{
+  if (eventflag_set (ev, m))
+    chopstx_sem_post_from_isr (&ev->sem);
 }
@@ -2,15 +2,28 @@ typedef uint32_t eventmask_t;
 
 struct eventflag {
   eventmask_t flags;
+  eventmask_t mask;		/* Bits which a thread waits for.  */
+  uint16_t wait_all;		/* It waits for all bits of MASK.  */
+  uint16_t poll;		/* Prepared for poll.  */
+  chopstx_sem_t sem;
+  /* For poll by chopstx_poll_cond_t.  */
   chopstx_mutex_t mutex;
   chopstx_cond_t cond;
 };
 
+#define EVENTFLAG_WAIT_ANY 0
+#define EVENTFLAG_WAIT_ALL 1
+
 void eventflag_init (struct eventflag *ev);
 eventmask_t eventflag_wait (struct eventflag *ev);
 eventmask_t eventflag_wait_timeout (struct eventflag *ev, uint32_t usec);
+eventmask_t eventflag_wait_mask (struct eventflag *ev, eventmask_t mask,
+				 int mode, uint32_t *usec_p);
 void eventflag_signal (struct eventflag *ev, eventmask_t m);
+void eventflag_signal_from_isr (struct eventflag *ev, eventmask_t m);
 
 /* For polling */
+void eventflag_prepare_poll_sem (struct eventflag *ev, chopstx_poll_sem_t *p);
+/* Deprecated, use eventflag_prepare_poll_sem instead.  */
 void eventflag_prepare_poll (struct eventflag *ev, chopstx_poll_cond_t *p);
 eventmask_t eventflag_get (struct eventflag *ev);
@@ -38,6 +38,12 @@ static const char *help_string =
   "adc;                    get 256-byte from ADC\r\n"
 #endif
   "sysinfo;                system information\r\n"
+#ifdef CHX_MUTEX_PROFILE
+  "mutex;                  mutex contention profile\r\n"
+#endif
+#ifdef CHX_TRACE
+  "trace;                  dump scheduler trace in hex\r\n"
+#endif
   "help\r\n";
 
 static char hexchar (uint8_t x)
@@ -51,7 +57,7 @@ static char hexchar (uint8_t x)
     return '?';
 }
 
-#ifdef TOUCH_SUPPORT
+#if defined(TOUCH_SUPPORT) || defined(CHX_MUTEX_PROFILE)
 static char *
 compose_decimal (char *s, int value)
 {
@@ -512,6 +518,72 @@ cmd_sysinfo (struct tty *tty, const char *line)
 }
 
 
+#ifdef CHX_MUTEX_PROFILE
+#define MAX_MUTEXES 16
+
+static void
+cmd_mutex (struct tty *tty, const char *line)
+{
+  struct chopstx_mutex_stats st[MAX_MUTEXES];
+  char output[128];
+  char *s;
+  int i, n;
+
+  (void)line;
+  n = chopstx_mutex_profile (st, MAX_MUTEXES);
+  put_line (tty, "MUTEX: ACQUIRED CONTENDED BOOSTED WAIT_TOTAL WAIT_MAX\r\n");
+  for (i = 0; i < n; i++)
+    {
+      s = compose_hex_ptr (output, (uintptr_t)st[i].mutex);
+      *s++ = ':';
+      *s++ = ' ';
+      s = compose_decimal (s, st[i].acquired);
+      *s++ = ' ';
+      s = compose_decimal (s, st[i].contended);
+      *s++ = ' ';
+      s = compose_decimal (s, st[i].boosted);
+      *s++ = ' ';
+      s = compose_decimal (s, st[i].wait_total_usec);
+      *s++ = ' ';
+      s = compose_decimal (s, st[i].wait_max_usec);
+      *s++ = '\r';
+      *s++ = '\n';
+      tty_send (tty, output, s - output);
+    }
+}
+#endif
+
+
+#ifdef CHX_TRACE
+/*
+ * Dump the trace buffer in hex, which can be converted by
+ * tool/chopstx-trace.py.
+ */
+static void
+cmd_trace (struct tty *tty, const char *line)
+{
+  const uint8_t *p = (const uint8_t *)chopstx_trace_get ();
+  int len = (int)sizeof (struct chopstx_trace);
+  char output[68];
+  char *s;
+  int i, j;
+
+  (void)line;
+  chopstx_trace_enable (0);
+  for (i = 0; i < len; i += 32)
+    {
+      s = output;
+      for (j = i; j < i + 32 && j < len; j++)
+	s = compose_hex_byte (s, p[j]);
+      *s++ = '\r';
+      *s++ = '\n';
+      tty_send (tty, output, s - output);
+    }
+  chopstx_trace_enable (1);
+}
+#endif
+
+
 static void
 cmd_help (struct tty *tty, const char *line)
 {
@@ -536,6 +608,12 @@ struct command_table command_table[] = {
   { "adc", cmd_adc },
 #endif
   { "sysinfo", cmd_sysinfo },
+#ifdef CHX_MUTEX_PROFILE
+  { "mutex", cmd_mutex },
+#endif
+#ifdef CHX_TRACE
+  { "trace", cmd_trace },
+#endif
   { "help", cmd_help },
 };
 
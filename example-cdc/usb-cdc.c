@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <chopstx.h>
 #include <string.h>
+#include <ring.h>
 #include "usb_lld.h"
 #include "tty.h"
 
@@ -43,9 +44,9 @@ struct tty {
   chopstx_cond_t cnd;
   uint8_t inputline[LINEBUFSIZE];   /* Line editing is supported */
   uint8_t send_buf[LINEBUFSIZE];    /* Sending ring buffer for echo back */
+  struct ring send_ring;
   uint32_t inputline_len    : 8;
-  uint32_t send_head        : 8;
-  uint32_t send_tail        : 8;
+  uint32_t                  : 16;
   uint32_t flag_connected   : 1;
   uint32_t flag_send_ready  : 1;
   uint32_t flag_input_avail : 1;
@@ -244,7 +245,7 @@ usb_device_reset (struct usb_dev *dev)
 
   chopstx_mutex_lock (&tty0.mtx);
   tty0.inputline_len = 0;
-  tty0.send_head = tty0.send_tail = 0;
+  ring_init (&tty0.send_ring, tty0.send_buf, LINEBUFSIZE);
   tty0.flag_connected = 0;
   tty0.flag_send_ready = 1;
   tty0.flag_input_avail = 0;
@@ -486,49 +487,15 @@ usb_get_status_interface (struct usb_dev *dev)
 
 
 /*
- * Put a character into the ring buffer to be send back.
+ * Put a character into the ring buffer to be send back.  When it's
+ * full, all that we can do is ignore this char.
  */
-static void
-put_char_to_ringbuffer (struct tty *t, int c)
-{
-  uint32_t next = (t->send_tail + 1) % LINEBUFSIZE;
-
-  if (t->send_head == next)
-    /* full */
-    /* All that we can do is ignore this char. */
-    return;
-  
-  t->send_buf[t->send_tail] = c;
-  t->send_tail = next;
-}
-
-/*
- * Get characters from ring buffer into S.
- */
-static int
-get_chars_from_ringbuffer (struct tty *t, uint8_t *s, int len)
-{
-  int i = 0;
-
-  if (t->send_head == t->send_tail)
-    /* Empty */
-    return i;
-
-  do
-    {
-      s[i++] = t->send_buf[t->send_head];
-      t->send_head = (t->send_head + 1) % LINEBUFSIZE;
-    }
-  while (t->send_head != t->send_tail && i < len);
-
-  return i;
-}
-
-
 static void
 tty_echo_char (struct tty *t, int c)
 {
-  put_char_to_ringbuffer (t, c);
+  uint8_t ch = c;
+
+  ring_push (&t->send_ring, &ch, 1, NULL);
 }
 
 
@@ -653,7 +620,7 @@ tty_open (void)
   chopstx_mutex_init (&tty0.mtx);
   chopstx_cond_init (&tty0.cnd);
   tty0.inputline_len = 0;
-  tty0.send_head = tty0.send_tail = 0;
+  ring_init (&tty0.send_ring, tty0.send_buf, LINEBUFSIZE);
   tty0.flag_connected = 0;
   tty0.flag_send_ready = 1;
   tty0.flag_input_avail = 0;
@@ -804,7 +771,7 @@ tty_main (void *arg)
 	  && t->flag_send_ready)
 	{
 	  uint8_t line[32];
-	  int len = get_chars_from_ringbuffer (t, line, sizeof (len));
+	  int len = ring_pop (&t->send_ring, line, sizeof (line));
 
 	  if (len)
 	    {
@@ -838,7 +805,7 @@ tty_wait_connection (struct tty *t)
     chopstx_cond_wait (&t->cnd, &t->mtx);
   t->flag_send_ready = 1;
   t->flag_input_avail = 0;
-  t->send_head = t->send_tail = 0;
+  ring_init (&t->send_ring, t->send_buf, LINEBUFSIZE);
   t->inputline_len = 0;
   usb_lld_rx_enable (ENDP3);	/* Accept input for line */
   chopstx_mutex_unlock (&t->mtx);
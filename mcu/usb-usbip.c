@@ -1465,13 +1465,10 @@ void chx_handle_intr (uint32_t irq_num);
 static void
 usb_intr (int signum, siginfo_t *siginfo, void *arg)
 {
-  extern void chx_sigmask (ucontext_t *uc);
-
-  ucontext_t *uc = arg;
   (void)signum;
   (void)siginfo;
+  (void)arg;
   chx_handle_intr (INTR_REQ_USB);
-  chx_sigmask (uc);
 }
 
 
@@ -1541,8 +1538,8 @@ usb_lld_init (struct usb_dev *dev, uint8_t feature)
     }
 
   act.sa_sigaction = usb_intr;
-  sigfillset (&act.sa_mask);
-  act.sa_flags = SA_SIGINFO|SA_RESTART;
+  sigemptyset (&act.sa_mask);
+  act.sa_flags = SA_SIGINFO|SA_RESTART|SA_NODEFER;
   sigaction (SIGUSR1, &act, NULL);
 
   pthread_sigmask (SIG_UNBLOCK, &sigset, NULL);
@@ -0,0 +1,208 @@
+/*
+ * ring.h - Lock-free single-producer/single-consumer ring buffer
+ *
+ * Copyright (C) 2026  agent
+ * Author: agent <agent@local>
+ *
+ * This file is a part of Chopstx, a thread library for embedded.
+ *
+ * Chopstx is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chopstx is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7, you may
+ * distribute non-source form of the Program without the copy of the
+ * GNU GPL normally required by section 4, provided you inform the
+ * receipents of GNU GPL by a written offer.
+ *
+ */
+
+/*
+ * A ring buffer of bytes, for a producer and a consumer, without
+ * lock.  The producer may be an interrupt handler.
+ *
+ * Indexes are free running, and masked to access the buffer, so, the
+ * size of the buffer should be power of 2.  HEAD is only written by
+ * the consumer, and TAIL is only written by the producer.
+ *
+ * The ring itself doesn't wake up the consumer.  ring_push tells the
+ * producer the transition from empty to non-empty, and the producer
+ * is expected to wake up the consumer then (say, by eventflag_signal).
+ * The consumer should use a wakeup which is not lost when it comes
+ * before its wait, and should wait only after ring_pop returns 0.
+ */
+
+#ifndef CHOPSTX_RING_H
+#define CHOPSTX_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct ring {
+  uint32_t head;		/* Index to pop.  */
+  uint32_t tail;		/* Index to push.  */
+  uint32_t mask;		/* Size of BUF - 1.  */
+  uint8_t *buf;
+};
+
+#if defined(GNU_LINUX_EMULATION)
+/* Producer may be another thread of the host (emulated hardware).  */
+#define ring_load_acquire(p)     __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define ring_store_release(p,v)  __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define ring_fence()             __atomic_thread_fence (__ATOMIC_SEQ_CST)
+#else
+/* Uniprocessor: only compiler barrier is needed.  */
+#define ring_load_acquire(p) \
+  ({ uint32_t v__ = *(volatile uint32_t *)(p); \
+     asm volatile ("" : : : "memory"); v__; })
+#define ring_store_release(p,v) \
+  do { asm volatile ("" : : : "memory"); \
+       *(volatile uint32_t *)(p) = (v); } while (0)
+#define ring_fence()             asm volatile ("" : : : "memory")
+#endif
+
+/* SIZE should be power of 2.  */
+static inline void
+ring_init (struct ring *r, uint8_t *buf, uint32_t size)
+{
+  r->head = r->tail = 0;
+  r->mask = size - 1;
+  r->buf = buf;
+}
+
+/* Number of bytes in the ring.  For the consumer.  */
+static inline uint32_t
+ring_count (struct ring *r)
+{
+  return ring_load_acquire (&r->tail) - r->head;
+}
+
+/* Number of free bytes in the ring.  For the producer.  */
+static inline uint32_t
+ring_space (struct ring *r)
+{
+  return r->mask + 1 - (r->tail - ring_load_acquire (&r->head));
+}
+
+/*
+ * Get the contiguous free span to write directly.  Returns its
+ * length, and the address is stored into *P.  Call ring_push_commit
+ * after writing.
+ */
+static inline uint32_t
+ring_push_span (struct ring *r, uint8_t **p)
+{
+  uint32_t i = r->tail & r->mask;
+  uint32_t n = ring_space (r);
+
+  if (n > r->mask + 1 - i)
+    n = r->mask + 1 - i;
+  *p = r->buf + i;
+  return n;
+}
+
+/*
+ * Make N bytes written by the producer available to the consumer.
+ * Returns 1 when the consumer may have seen the ring empty, and
+ * should be woken up.
+ */
+static inline int
+ring_push_commit (struct ring *r, uint32_t n)
+{
+  uint32_t tail = r->tail;
+
+  if (n == 0)
+    return 0;
+
+  ring_store_release (&r->tail, tail + n);
+  ring_fence ();
+  return ring_load_acquire (&r->head) == tail;
+}
+
+/*
+ * Push up to LEN bytes of DATA.  Returns number of bytes pushed.
+ * When WAKEUP_P is not NULL, *WAKEUP_P is set to 1 if the consumer
+ * should be woken up, or 0.
+ */
+static inline uint32_t
+ring_push (struct ring *r, const void *data, uint32_t len, int *wakeup_p)
+{
+  const uint8_t *s = data;
+  uint32_t tail = r->tail;
+  uint32_t i = tail & r->mask;
+  uint32_t n, n0;
+  int wakeup;
+
+  n = ring_space (r);
+  if (n > len)
+    n = len;
+
+  n0 = r->mask + 1 - i;
+  if (n0 > n)
+    n0 = n;
+  memcpy (r->buf + i, s, n0);
+  memcpy (r->buf, s + n0, n - n0);
+
+  wakeup = ring_push_commit (r, n);
+  if (wakeup_p)
+    *wakeup_p = wakeup;
+  return n;
+}
+
+/*
+ * Get the contiguous span of data to read directly.  Returns its
+ * length, and the address is stored into *P.  Call ring_pop_commit
+ * after reading.
+ */
+static inline uint32_t
+ring_pop_span (struct ring *r, const uint8_t **p)
+{
+  uint32_t i = r->head & r->mask;
+  uint32_t n = ring_count (r);
+
+  if (n > r->mask + 1 - i)
+    n = r->mask + 1 - i;
+  *p = r->buf + i;
+  return n;
+}
+
+/* Release N bytes read by the consumer to the producer.  */
+static inline void
+ring_pop_commit (struct ring *r, uint32_t n)
+{
+  ring_store_release (&r->head, r->head + n);
+  ring_fence ();
+}
+
+/* Pop up to LEN bytes into DATA.  Returns number of bytes popped.  */
+static inline uint32_t
+ring_pop (struct ring *r, void *data, uint32_t len)
+{
+  uint8_t *d = data;
+  uint32_t i = r->head & r->mask;
+  uint32_t n, n0;
+
+  n = ring_count (r);
+  if (n > len)
+    n = len;
+
+  n0 = r->mask + 1 - i;
+  if (n0 > n)
+    n0 = n;
+  memcpy (d, r->buf + i, n0);
+  memcpy (d + n0, r->buf, n - n0);
+
+  ring_pop_commit (r, n);
+  return n;
+}
+#endif
@@ -0,0 +1,170 @@
+#! /usr/bin/python3
+
+"""
+chopstx-trace.py - Convert a dump of Chopstx scheduler trace to JSON
+
+Copyright (C) 2026  agent
+Author: agent <agent@local>
+
+This file is a part of Chopstx, a thread library for embedded.
+
+Chopstx is free software: you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Chopstx is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Usage: chopstx-trace.py DUMP [OUTPUT.json]
+
+DUMP is the content of struct chopstx_trace, in binary (the file
+written by the emulation with CHOPSTX_TRACE=FILE), or in hex text
+(the output of "trace" command of the example).  The output is in
+Trace Event Format, which can be loaded by Chrome (chrome://tracing)
+or Perfetto UI.
+"""
+
+import sys, struct, json, binascii
+
+MAGIC = 0x54584843
+HEADER = '<IHHIIII'
+
+EV_SWITCH = 1
+EV_WAKEUP = 2
+EV_TIMER = 3
+EV_INTR = 4
+EV_MUTEX_WAIT = 5
+EV_MUTEX_LOCK = 6
+EV_COND_WAIT = 7
+EV_COND_SIGNAL = 8
+
+STATE = { 2: "mutex", 3: "cond", 4: "time", 5: "join", 6: "poll" }
+
+TID_IDLE = 0
+TID_INTR = 1
+
+def read_dump(filename):
+    with open(filename, 'rb') as f:
+        data = f.read()
+    if len(data) >= 4 and struct.unpack('<I', data[0:4])[0] == MAGIC:
+        return data
+    # Hex text: use lines which only have hex digits.
+    hexdigits = set(b'0123456789abcdefABCDEF')
+    h = b''
+    for line in data.splitlines():
+        line = line.strip()
+        if line and all(c in hexdigits for c in line):
+            h += line
+    return binascii.unhexlify(h)
+
+def records(data):
+    magic, rec_size, size, mhz, index, enabled, reserved = \
+        struct.unpack_from(HEADER, data, 0)
+    if magic != MAGIC:
+        raise ValueError("not a chopstx trace")
+    if rec_size == 16:
+        fmt = '<IBBHII'
+    elif rec_size == 24:
+        fmt = '<IBBHQQ'
+    else:
+        raise ValueError("unknown record size: %d" % rec_size)
+    offset = struct.calcsize(HEADER)
+    recs = [ struct.unpack_from(fmt, data, offset + i * rec_size)
+             for i in range(size) ]
+    if index <= size:
+        recs = recs[0:index]
+    else:
+        start = index % size
+        recs = recs[start:] + recs[0:start]
+    return mhz, recs
+
+def tid_of(thd):
+    return thd if thd else TID_IDLE
+
+def convert(mhz, recs):
+    events = []
+    threads = {}
+    running = None              # (tid, ts, prio)
+    waiting = {}                # tid -> (name, id) of async event
+    ticks = 0
+    time_prev = None
+
+    def thread_name(thd):
+        if thd not in threads:
+            threads[thd] = "thread %#x" % thd
+        return threads[thd]
+
+    def end_wait(tid, ts):
+        if tid in waiting:
+            name, cat = waiting.pop(tid)
+            events.append({ "name": name, "cat": cat, "ph": "e",
+                            "id": tid, "pid": 1, "tid": tid, "ts": ts })
+
+    for (time, event, prio, arg, thd, obj) in recs:
+        # Unwrap 32-bit ticks.
+        if time_prev is not None:
+            ticks += (time - time_prev) & 0xffffffff
+        time_prev = time
+        ts = ticks / mhz
+
+        if event == EV_SWITCH:
+            if running:
+                tid0, ts0, prio0 = running
+                events.append({ "name": "idle" if tid0 == TID_IDLE
+                                else "prio %d" % prio0,
+                                "ph": "X", "pid": 1, "tid": tid0,
+                                "ts": ts0, "dur": ts - ts0 })
+            if thd:
+                thread_name(thd)
+            running = (tid_of(thd), ts, prio)
+        elif event == EV_WAKEUP:
+            thread_name(thd)
+            end_wait(thd, ts)
+            events.append({ "name": "wakeup (%s)" % STATE.get(arg, arg),
+                            "ph": "i", "s": "t", "pid": 1, "tid": thd,
+                            "ts": ts, "args": { "prio": prio } })
+        elif event == EV_TIMER or event == EV_INTR:
+            name = "timer" if event == EV_TIMER else "irq %d" % arg
+            events.append({ "name": name, "ph": "i", "s": "t",
+                            "pid": 1, "tid": TID_INTR, "ts": ts })
+        elif event == EV_MUTEX_WAIT or event == EV_COND_WAIT:
+            cat = "mutex" if event == EV_MUTEX_WAIT else "cond"
+            name = "%s %#x" % (cat, obj)
+            thread_name(thd)
+            end_wait(thd, ts)
+            waiting[thd] = (name, cat)
+            events.append({ "name": name, "cat": cat, "ph": "b",
+                            "id": thd, "pid": 1, "tid": thd, "ts": ts })
+        elif event == EV_MUTEX_LOCK:
+            end_wait(thd, ts)
+        elif event == EV_COND_SIGNAL:
+            name = ("broadcast %#x" if arg else "signal %#x") % obj
+            events.append({ "name": name, "ph": "i", "s": "t",
+                            "pid": 1, "tid": tid_of(thd), "ts": ts })
+
+    meta = [ { "name": "thread_name", "ph": "M", "pid": 1, "tid": TID_IDLE,
+               "args": { "name": "idle" } },
+             { "name": "thread_name", "ph": "M", "pid": 1, "tid": TID_INTR,
+               "args": { "name": "interrupt" } } ]
+    for thd, name in threads.items():
+        meta.append({ "name": "thread_name", "ph": "M", "pid": 1,
+                      "tid": thd, "args": { "name": name } })
+    return { "traceEvents": meta + events, "displayTimeUnit": "ns" }
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("Usage: %s DUMP [OUTPUT.json]" % sys.argv[0], file=sys.stderr)
+        sys.exit(1)
+    mhz, recs = records(read_dump(sys.argv[1]))
+    result = convert(mhz, recs)
+    if len(sys.argv) >= 3:
+        with open(sys.argv[2], 'w') as f:
+            json.dump(result, f)
+    else:
+        json.dump(result, sys.stdout)